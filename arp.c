@@ -10,6 +10,7 @@
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
+#include "gso.h"
 
 /* see https://www.iana.org/assignments/arp-parameters/arp-parameters.txt */
 #define ARP_HRD_ETHER 0x0001
@@ -19,13 +20,45 @@
 #define ARP_OP_REQUEST 0x0001
 #define ARP_OP_REPLY   0x0002
 
-#define ARP_CACHE_SIZE 32
-#define ARP_CACHE_TIMEOUT 30 /* seconds */
+#ifndef ARP_CACHE_SIZE_MAX
+#define ARP_CACHE_SIZE_MAX 4096 /* maximum number of entries */
+#endif
+#define ARP_CACHE_CHUNK_SIZE 64 /* number of entries allocated at once */
+#define ARP_REACHABLE_TIME 30 /* seconds, lifetime of the confirmed entry */
+#define ARP_STALE_TIMEOUT 60 /* seconds, an unused stale entry is deleted after this */
+#define ARP_PENDING_QUEUE_SIZE 16 /* packets waiting for the resolution per neighbor */
+#define ARP_FAILED_TIMEOUT 3 /* seconds, lifetime of the negative cache */
+
+#define ARP_REQUEST_TIMEOUT 500000 /* micro seconds, doubled on each retransmission */
+#define ARP_REQUEST_RETRY_MAX 3 /* number of requests before giving up */
+#define ARP_PROBE_RETRY_MAX 3 /* number of unicast probes before giving up */
+
+#define ARP_RATE_LIMIT_RATE  50 /* requests per second (all neighbors) */
+#define ARP_RATE_LIMIT_BURST 100
 
+#define ARP_TABLE_SIZE_MIN 64 /* initial number of buckets (must be a power of 2) */
+#define ARP_TABLE_LOAD_FACTOR 2 /* grow the table if entries exceed buckets * this */
+
+/*
+ * NOTE: Neighbor Unreachability Detection (like RFC 4861, simplified)
+ *
+ *   INCOMPLETE -> REACHABLE -> STALE -> (used) -> PROBE -> REACHABLE
+ *
+ *   An entry which is used while REACHABLE goes to PROBE directly, so a busy
+ *   neighbor is refreshed with unicast probes before it expires. The entries
+ *   in REACHABLE, STALE and PROBE are all usable for the transmission.
+ */
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
-#define ARP_CACHE_STATE_RESOLVED   2
+#define ARP_CACHE_STATE_REACHABLE  2
 #define ARP_CACHE_STATE_STATIC     3
+#define ARP_CACHE_STATE_FAILED     4 /* negative cache */
+#define ARP_CACHE_STATE_STALE      5
+#define ARP_CACHE_STATE_PROBE      6
+
+#define ARP_CACHE_STATE_USABLE(x) \
+    ((x) == ARP_CACHE_STATE_REACHABLE || (x) == ARP_CACHE_STATE_STALE || \
+     (x) == ARP_CACHE_STATE_PROBE || (x) == ARP_CACHE_STATE_STATIC)
 
 struct arp_hdr {
     uint16_t hrd;
@@ -44,14 +77,49 @@ struct arp_ether {
 };
 
 struct arp_cache {
+    struct arp_cache *next; /* chain of the bucket (or the free list) */
     unsigned char state;
+    unsigned char referenced; /* for the CLOCK (second chance) eviction */
+    unsigned char used; /* used since the last confirmation (triggers the probe) */
+    struct net_iface *iface;
     ip_addr_t pa;
     uint8_t ha[ETHER_ADDR_LEN];
     struct timeval timestamp;
+    struct queue_head pending; /* packets waiting for the resolution */
+    struct timeval retransmit; /* time to send the next request */
+    unsigned int rto; /* micro seconds */
+    unsigned int retries;
+};
+
+/* NOTE: the data follows immediately after the structure */
+struct arp_pending_entry {
+    size_t len;
+    uint16_t gso_size;
+};
+
+/* NOTE: the buckets follow immediately after the structure */
+struct arp_table {
+    struct arp_table *prev; /* retired table (never freed, it may be referred by readers) */
+    unsigned int size; /* number of buckets */
 };
 
+/*
+ * NOTE: The table is updated under the mutex and the seqlock. arp_resolve()
+ *       reads it without any lock and retries if it is updated meanwhile.
+ *       The entries and the tables are never freed for the lock-free readers.
+ */
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE];
+static seqlock_t seqlock = SEQLOCK_INITIALIZER;
+static struct arp_table *table;
+static unsigned int num; /* number of entries in the table */
+static struct arp_cache *chunks[ARP_CACHE_SIZE_MAX / ARP_CACHE_CHUNK_SIZE]; /* pool of entries */
+static unsigned int chunk_num;
+static struct arp_cache *freelist;
+static unsigned int hand; /* clock hand for eviction */
+static struct {
+    unsigned int tokens;
+    struct timeval last;
+} ratelimit; /* token bucket for the broadcast requests */
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -97,58 +165,207 @@ arp_dump(const uint8_t *data, size_t len)
  * NOTE: ARP Cache functions must be called after mutex locked
  */
 
+static struct arp_cache **
+arp_table_buckets(struct arp_table *tbl)
+{
+    return (struct arp_cache **)(tbl + 1);
+}
+
+static unsigned int
+arp_table_hash(struct arp_table *tbl, struct net_iface *iface, ip_addr_t pa)
+{
+    struct {
+        struct net_iface *iface;
+        ip_addr_t pa;
+    } key;
+
+    memset(&key, 0, sizeof(key));
+    key.iface = iface;
+    key.pa = pa;
+    return hash32(&key, sizeof(key), 0) & (tbl->size - 1);
+}
+
+static struct arp_table *
+arp_table_alloc(unsigned int size)
+{
+    struct arp_table *tbl;
+
+    tbl = memory_alloc(sizeof(*tbl) + sizeof(struct arp_cache *) * size);
+    if (!tbl) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    tbl->size = size;
+    return tbl;
+}
+
+/* NOTE: must be called in the seqlock write section */
+static void
+arp_table_grow(void)
+{
+    struct arp_table *tbl;
+    struct arp_cache *entry, *next, **bucket;
+    unsigned int i;
+
+    tbl = arp_table_alloc(table->size * 2);
+    if (!tbl) {
+        /* keep using the current table */
+        return;
+    }
+    for (i = 0; i < table->size; i++) {
+        for (entry = arp_table_buckets(table)[i]; entry; entry = next) {
+            next = entry->next;
+            bucket = &arp_table_buckets(tbl)[arp_table_hash(tbl, entry->iface, entry->pa)];
+            entry->next = *bucket;
+            *bucket = entry;
+        }
+    }
+    tbl->prev = table;
+    __atomic_store_n(&table, tbl, __ATOMIC_RELEASE);
+    debugf("grown, size=%u, num=%u", tbl->size, num);
+}
+
 static struct arp_cache *
-arp_cache_alloc(void)
+arp_cache_entry(unsigned int index)
 {
-    struct arp_cache *entry, *oldest = NULL;
+    return &chunks[index / ARP_CACHE_CHUNK_SIZE][index % ARP_CACHE_CHUNK_SIZE];
+}
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state == ARP_CACHE_STATE_FREE) {
-            return entry;
+/* CLOCK: an entry referenced since the last sweep gets a second chance */
+static struct arp_cache *
+arp_cache_evict(void)
+{
+    struct arp_cache *entry;
+    unsigned int n, total;
+
+    total = chunk_num * ARP_CACHE_CHUNK_SIZE;
+    for (n = 0; n < total * 2; n++) {
+        entry = arp_cache_entry(hand++ % total);
+        if (entry->state == ARP_CACHE_STATE_STATIC) {
+            continue;
+        }
+        if (entry->state == ARP_CACHE_STATE_INCOMPLETE && entry->pending.num) {
+            /* never evict the entries which have packets waiting */
+            continue;
+        }
+        if (entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+static void
+arp_cache_delete(struct arp_cache *cache);
+
+static struct arp_cache *
+arp_cache_alloc(void)
+{
+    struct arp_cache *entry;
+    int i;
+
+    if (!freelist && chunk_num < countof(chunks)) {
+        chunks[chunk_num] = memory_alloc(sizeof(struct arp_cache) * ARP_CACHE_CHUNK_SIZE);
+        if (chunks[chunk_num]) {
+            for (i = ARP_CACHE_CHUNK_SIZE - 1; i >= 0; i--) {
+                chunks[chunk_num][i].next = freelist;
+                freelist = &chunks[chunk_num][i];
+            }
+            chunk_num++;
         }
-        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
-            oldest = entry;
+    }
+    if (!freelist) {
+        entry = arp_cache_evict();
+        if (!entry) {
+            return NULL;
         }
+        arp_cache_delete(entry);
     }
-    return oldest;
+    entry = freelist;
+    freelist = entry->next;
+    entry->next = NULL;
+    return entry;
 }
 
 static struct arp_cache *
-arp_cache_select(ip_addr_t pa)
+arp_cache_select(struct net_iface *iface, ip_addr_t pa)
 {
     struct arp_cache *entry;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) {
+    for (entry = arp_table_buckets(table)[arp_table_hash(table, iface, pa)]; entry; entry = entry->next) {
+        if (entry->iface == iface && entry->pa == pa) {
             return entry;
         }
     }
     return NULL;
 }
 
+/* NOTE: lock-free, it can be called without the mutex */
+static int
+arp_cache_lookup(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+{
+    struct arp_table *tbl;
+    struct arp_cache *entry;
+    unsigned int seq, n;
+    int found;
+
+    do {
+        seq = seqlock_read_begin(&seqlock);
+        found = 0;
+        tbl = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+        entry = __atomic_load_n(&arp_table_buckets(tbl)[arp_table_hash(tbl, iface, pa)], __ATOMIC_ACQUIRE);
+        for (n = 0; entry && n < ARP_CACHE_SIZE_MAX; n++) {
+            if (entry->iface == iface && entry->pa == pa) {
+                if (ARP_CACHE_STATE_USABLE(entry->state)) {
+                    memcpy(ha, entry->ha, ETHER_ADDR_LEN);
+                    found = 1;
+                }
+                break;
+            }
+            entry = __atomic_load_n(&entry->next, __ATOMIC_ACQUIRE);
+        }
+    } while (seqlock_read_retry(&seqlock, seq));
+    if (found) {
+        __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&entry->used, 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
 static struct arp_cache *
-arp_cache_update(ip_addr_t pa, const uint8_t *ha)
+arp_cache_update(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
-    cache = arp_cache_select(pa);
+    cache = arp_cache_select(iface, pa);
     if (!cache) {
         /* not found */
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
+    if (cache->state == ARP_CACHE_STATE_STATIC) {
+        /* never overwritten by the received messages */
+        return cache;
+    }
+    seqlock_write_begin(&seqlock);
+    cache->state = ARP_CACHE_STATE_REACHABLE;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    seqlock_write_end(&seqlock);
+    cache->used = 0;
+    cache->retries = 0;
+    cache->rto = ARP_REQUEST_TIMEOUT;
     gettimeofday(&cache->timestamp, NULL);
     debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
 static struct arp_cache *
-arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
+arp_cache_insert(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha, unsigned char state)
 {
-    struct arp_cache *cache;
+    struct arp_cache *cache, **bucket;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
@@ -157,29 +374,99 @@ arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
-    cache->state = ARP_CACHE_STATE_RESOLVED;
+    seqlock_write_begin(&seqlock);
+    cache->state = state;
+    cache->referenced = 0;
+    cache->used = 0;
+    cache->retries = 0;
+    cache->rto = ARP_REQUEST_TIMEOUT;
+    cache->iface = iface;
     cache->pa = pa;
-    memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    if (ha) {
+        memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+    }
+    if (num >= table->size * ARP_TABLE_LOAD_FACTOR) {
+        arp_table_grow();
+    }
+    bucket = &arp_table_buckets(table)[arp_table_hash(table, iface, pa)];
+    cache->next = *bucket;
+    __atomic_store_n(bucket, cache, __ATOMIC_RELEASE);
+    num++;
+    seqlock_write_end(&seqlock);
     gettimeofday(&cache->timestamp, NULL);
-    debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+    debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
     return cache;
 }
 
 static void
 arp_cache_delete(struct arp_cache *cache)
 {
+    struct arp_cache **p;
+    struct arp_pending_entry *entry;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
     debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
+    seqlock_write_begin(&seqlock);
+    for (p = &arp_table_buckets(table)[arp_table_hash(table, cache->iface, cache->pa)]; *p; p = &(*p)->next) {
+        if (*p == cache) {
+            *p = cache->next;
+            num--;
+            break;
+        }
+    }
     cache->state = ARP_CACHE_STATE_FREE;
+    cache->iface = NULL;
     cache->pa = 0;
     memset(cache->ha, 0, ETHER_ADDR_LEN);
+    cache->next = freelist;
+    seqlock_write_end(&seqlock);
+    freelist = cache;
     timerclear(&cache->timestamp);
+    while ((entry = queue_pop(&cache->pending)) != NULL) {
+        memory_free(entry);
+    }
 }
 
 static int
-arp_request(struct net_iface *iface, ip_addr_t tpa)
+arp_cache_pending_push(struct arp_cache *cache, const uint8_t *data, size_t len, uint16_t gso_size)
+{
+    struct arp_pending_entry *entry;
+
+    if (cache->pending.num >= ARP_PENDING_QUEUE_SIZE) {
+        /* drop the oldest one */
+        memory_free(queue_pop(&cache->pending));
+    }
+    entry = memory_alloc(sizeof(*entry) + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->len = len;
+    entry->gso_size = gso_size;
+    memcpy(entry + 1, data, len);
+    if (!queue_push(&cache->pending, entry)) {
+        errorf("queue_push() failure");
+        memory_free(entry);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: transmit the packets taken out of the resolved entry, must be called after mutex unlocked */
+static void
+arp_pending_flush(struct net_iface *iface, struct queue_head *pending, const uint8_t *ha)
+{
+    struct arp_pending_entry *entry;
+
+    while ((entry = queue_pop(pending)) != NULL) {
+        gso_output(iface->dev, NET_PROTOCOL_TYPE_IP, (uint8_t *)(entry + 1), entry->len, ha, entry->gso_size);
+        memory_free(entry);
+    }
+}
+
+static int
+arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *dst)
 {
     struct arp_ether request;
 
@@ -194,7 +481,7 @@ arp_request(struct net_iface *iface, ip_addr_t tpa)
     memcpy(request.tpa, &tpa, IP_ADDR_LEN);
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
     arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), dst);
 }
 
 static int
@@ -216,6 +503,55 @@ arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint
     return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
 }
 
+/* NOTE: must be called after mutex locked */
+static int
+arp_ratelimit(const struct timeval *now)
+{
+    struct timeval diff;
+    unsigned long elapsed, tokens;
+
+    timersub(now, &ratelimit.last, &diff);
+    elapsed = diff.tv_sec * 1000000 + diff.tv_usec;
+    tokens = elapsed * ARP_RATE_LIMIT_RATE / 1000000;
+    if (tokens) {
+        ratelimit.tokens = MIN(ratelimit.tokens + tokens, ARP_RATE_LIMIT_BURST);
+        ratelimit.last = *now;
+    }
+    if (!ratelimit.tokens) {
+        return -1;
+    }
+    ratelimit.tokens--;
+    return 0;
+}
+
+/*
+ * NOTE: Send a request for the incomplete entry (broadcast) or the probing
+ *       entry (unicast to the cached address) and schedule the next one with
+ *       exponential backoff. If the rate limit of the broadcasts is exceeded,
+ *       the request is postponed to the next tick of arp_timer().
+ *       Must be called after mutex locked.
+ */
+static void
+arp_cache_solicit(struct arp_cache *cache, const struct timeval *now)
+{
+    char addr[IP_ADDR_STR_LEN];
+
+    if (cache->state == ARP_CACHE_STATE_PROBE) {
+        arp_request(cache->iface, cache->pa, cache->ha);
+    } else {
+        if (arp_ratelimit(now) == -1) {
+            debugf("rate limited, pa=%s", ip_addr_ntop(cache->pa, addr, sizeof(addr)));
+            cache->retransmit = *now;
+            return;
+        }
+        arp_request(cache->iface, cache->pa, cache->iface->dev->broadcast);
+    }
+    cache->retries++;
+    cache->retransmit = *now;
+    timeval_add_usec(&cache->retransmit, cache->rto);
+    cache->rto *= 2;
+}
+
 static void
 arp_input(const uint8_t *data, size_t len, struct net_device *dev)
 {
@@ -223,6 +559,8 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     ip_addr_t spa, tpa;
     int merge = 0;
     struct net_iface *iface;
+    struct arp_cache *cache;
+    struct queue_head pending = {};
 
     if (len < sizeof(*msg)) {
         errorf("too short");
@@ -241,17 +579,28 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     arp_dump(data, len);
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
+    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (!iface) {
+        /* iface is not registered to the device */
+        return;
+    }
     mutex_lock(&mutex);
-    if (arp_cache_update(spa, msg->sha)) {
+    cache = arp_cache_update(iface, spa, msg->sha);
+    if (cache) {
         /* updated */
         merge = 1;
+        pending = cache->pending;
+        queue_init(&cache->pending);
     }
     mutex_unlock(&mutex);
-    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
-    if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
+    if (pending.num) {
+        debugf("flush pending packets, num=%u", pending.num);
+        arp_pending_flush(iface, &pending, msg->sha);
+    }
+    if (((struct ip_iface *)iface)->unicast == tpa) {
         if (!merge) {
             mutex_lock(&mutex);
-            arp_cache_insert(spa, msg->sha);
+            arp_cache_insert(iface, spa, msg->sha, ARP_CACHE_STATE_REACHABLE);
             mutex_unlock(&mutex);
         }
         if (ntoh16(msg->hdr.op) == ARP_OP_REQUEST) {
@@ -260,8 +609,12 @@ arp_input(const uint8_t *data, size_t len, struct net_device *dev)
     }
 }
 
+/*
+ * NOTE: If the address is not resolved yet and data is specified, the packet is
+ *       held in the entry and transmitted as soon as the reply arrives.
+ */
 int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, const uint8_t *data, size_t len, uint16_t gso_size)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
@@ -275,49 +628,188 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
         debugf("unsupported protocol address type");
         return ARP_RESOLVE_ERROR;
     }
+    if (arp_cache_lookup(iface, pa, ha)) {
+        debugf("resolved, pa=%s, ha=%s",
+            ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+        return ARP_RESOLVE_FOUND;
+    }
     mutex_lock(&mutex);
-    cache = arp_cache_select(pa);
+    cache = arp_cache_select(iface, pa);
     if (!cache) {
-        cache = arp_cache_alloc();
+        cache = arp_cache_insert(iface, pa, NULL, ARP_CACHE_STATE_INCOMPLETE);
         if (!cache) {
             mutex_unlock(&mutex);
-            errorf("arp_cache_alloc() failure");
+            errorf("arp_cache_insert() failure");
             return ARP_RESOLVE_ERROR;
         }
-        cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
-        gettimeofday(&cache->timestamp, NULL);
-        arp_request(iface, pa);
+        if (data) {
+            arp_cache_pending_push(cache, data, len, gso_size);
+        }
+        arp_cache_solicit(cache, &cache->timestamp);
         mutex_unlock(&mutex);
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
         return ARP_RESOLVE_INCOMPLETE;
     }
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
-        arp_request(iface, pa); /* just in case packet loss */
+        /* NOTE: the request is retransmitted by arp_timer(), not for each packet */
+        if (data) {
+            arp_cache_pending_push(cache, data, len, gso_size);
+        }
         mutex_unlock(&mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
+    if (cache->state == ARP_CACHE_STATE_FAILED) {
+        mutex_unlock(&mutex);
+        debugf("resolution failed recently, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
+        return ARP_RESOLVE_ERROR;
+    }
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+    cache->used = 1;
     mutex_unlock(&mutex);
     debugf("resolved, pa=%s, ha=%s",
         ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return ARP_RESOLVE_FOUND;
 }
 
+int
+arp_add_static(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha)
+{
+    struct arp_cache *cache;
+    struct queue_head pending = {};
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[ETHER_ADDR_STR_LEN];
+
+    if (iface->dev->type != NET_DEVICE_TYPE_ETHERNET || iface->family != NET_IFACE_FAMILY_IP) {
+        errorf("unsupported address type");
+        return -1;
+    }
+    mutex_lock(&mutex);
+    cache = arp_cache_select(iface, pa);
+    if (cache) {
+        seqlock_write_begin(&seqlock);
+        cache->state = ARP_CACHE_STATE_STATIC;
+        memcpy(cache->ha, ha, ETHER_ADDR_LEN);
+        seqlock_write_end(&seqlock);
+        pending = cache->pending;
+        queue_init(&cache->pending);
+    } else {
+        cache = arp_cache_insert(iface, pa, ha, ARP_CACHE_STATE_STATIC);
+        if (!cache) {
+            errorf("arp_cache_insert() failure");
+            mutex_unlock(&mutex);
+            return -1;
+        }
+    }
+    mutex_unlock(&mutex);
+    arp_pending_flush(iface, &pending, ha);
+    infof("pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
+    return 0;
+}
+
+int
+arp_delete_static(struct net_iface *iface, ip_addr_t pa)
+{
+    struct arp_cache *cache;
+    char addr[IP_ADDR_STR_LEN];
+
+    mutex_lock(&mutex);
+    cache = arp_cache_select(iface, pa);
+    if (!cache || cache->state != ARP_CACHE_STATE_STATIC) {
+        errorf("static entry not found, pa=%s", ip_addr_ntop(pa, addr, sizeof(addr)));
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    arp_cache_delete(cache);
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: send a gratuitous ARP, so that the neighbors learn (or update) our address */
+int
+arp_announce(struct net_iface *iface)
+{
+    ip_addr_t pa;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (iface->dev->type != NET_DEVICE_TYPE_ETHERNET || iface->family != NET_IFACE_FAMILY_IP) {
+        errorf("unsupported address type");
+        return -1;
+    }
+    pa = ((struct ip_iface *)iface)->unicast;
+    debugf("dev=%s, pa=%s", iface->dev->name, ip_addr_ntop(pa, addr, sizeof(addr)));
+    return arp_request(iface, pa, iface->dev->broadcast);
+}
+
 static void
 arp_timer(void)
 {
     struct arp_cache *entry;
+    struct arp_pending_entry *pending;
     struct timeval now, diff;
+    unsigned int i;
+    char addr[IP_ADDR_STR_LEN];
 
     mutex_lock(&mutex);
     gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            timersub(&now, &entry->timestamp, &diff);
-            if (diff.tv_sec > ARP_CACHE_TIMEOUT) {
+    for (i = 0; i < chunk_num * ARP_CACHE_CHUNK_SIZE; i++) {
+        entry = arp_cache_entry(i);
+        timersub(&now, &entry->timestamp, &diff);
+        switch (entry->state) {
+        case ARP_CACHE_STATE_INCOMPLETE:
+            if (timercmp(&now, &entry->retransmit, <)) {
+                break;
+            }
+            if (entry->retries >= ARP_REQUEST_RETRY_MAX) {
+                debugf("FAILED: pa=%s", ip_addr_ntop(entry->pa, addr, sizeof(addr)));
+                entry->state = ARP_CACHE_STATE_FAILED;
+                entry->timestamp = now;
+                while ((pending = queue_pop(&entry->pending)) != NULL) {
+                    memory_free(pending);
+                }
+                break;
+            }
+            arp_cache_solicit(entry, &now);
+            break;
+        case ARP_CACHE_STATE_REACHABLE:
+            if (diff.tv_sec < ARP_REACHABLE_TIME) {
+                break;
+            }
+            if (!entry->used) {
+                debugf("STALE: pa=%s", ip_addr_ntop(entry->pa, addr, sizeof(addr)));
+                entry->state = ARP_CACHE_STATE_STALE;
+                break;
+            }
+            /* fall through */
+        case ARP_CACHE_STATE_STALE:
+            if (entry->used) {
+                debugf("PROBE: pa=%s", ip_addr_ntop(entry->pa, addr, sizeof(addr)));
+                entry->state = ARP_CACHE_STATE_PROBE;
+                entry->used = 0;
+                entry->retries = 0;
+                entry->rto = ARP_REQUEST_TIMEOUT;
+                arp_cache_solicit(entry, &now);
+                break;
+            }
+            if (diff.tv_sec >= ARP_STALE_TIMEOUT) {
+                arp_cache_delete(entry);
+            }
+            break;
+        case ARP_CACHE_STATE_PROBE:
+            if (timercmp(&now, &entry->retransmit, <)) {
+                break;
+            }
+            if (entry->retries >= ARP_PROBE_RETRY_MAX) {
+                debugf("unreachable, pa=%s", ip_addr_ntop(entry->pa, addr, sizeof(addr)));
+                arp_cache_delete(entry);
+                break;
+            }
+            arp_cache_solicit(entry, &now);
+            break;
+        case ARP_CACHE_STATE_FAILED:
+            if (diff.tv_sec >= ARP_FAILED_TIMEOUT) {
                 arp_cache_delete(entry);
             }
+            break;
         }
     }
     mutex_unlock(&mutex);
@@ -326,8 +818,15 @@ arp_timer(void)
 int
 arp_init(void)
 {
-    struct timeval interval = {1, 0};
+    struct timeval interval = {0, 100000};
 
+    table = arp_table_alloc(ARP_TABLE_SIZE_MIN);
+    if (!table) {
+        errorf("arp_table_alloc() failure");
+        return -1;
+    }
+    ratelimit.tokens = ARP_RATE_LIMIT_BURST;
+    gettimeofday(&ratelimit.last, NULL);
     if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
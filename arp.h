@@ -1,6 +1,7 @@
 #ifndef ARP_H
 #define ARP_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "net.h"
@@ -11,7 +12,13 @@
 #define ARP_RESOLVE_FOUND       1
 
 extern int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha);
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, const uint8_t *data, size_t len, uint16_t gso_size);
+extern int
+arp_add_static(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha);
+extern int
+arp_delete_static(struct net_iface *iface, ip_addr_t pa);
+extern int
+arp_announce(struct net_iface *iface);
 extern int
 arp_init(void);
 
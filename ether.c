@@ -126,6 +126,10 @@ ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device
     type = ntoh16(hdr->type);
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
     ether_dump(frame, flen);
+    if (net_input_early_demux(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev) == 0) {
+        /* delivered directly to the established flow */
+        return 0;
+    }
     return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
 }
 
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "gro.h"
+
+/*
+ * Generic Receive Offload (GRO)
+ *
+ * Consecutive in-order TCP segments of the same flow are merged into one
+ * large segment before they are passed to the IP layer. The held segments
+ * are flushed at the end of each poll batch (see net_protocol_handler()).
+ *
+ * NOTE: PSH does not terminate the merge; the held segments are delivered
+ *       at the end of the batch anyway, so it does not delay the delivery.
+ */
+
+#define GRO_FLOW_SIZE 8
+
+#define GRO_FLOW_STATE_FREE     0
+#define GRO_FLOW_STATE_HELD     1
+#define GRO_FLOW_STATE_FLUSHING 2 /* being delivered without the mutex, the slot is not reusable yet */
+#define GRO_SEGS_MAX 44
+
+#define GRO_TCP_FLG_PSH 0x08
+#define GRO_TCP_FLG_ACK 0x10
+
+struct ip_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+};
+
+struct pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+struct tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct gro_flow {
+    int state;
+    struct net_device *dev;
+    int (*deliver)(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+    uint32_t next; /* next expected sequence number */
+    uint32_t psum; /* sum of the merged payloads (one's complement) */
+    unsigned int segs;
+    size_t len;
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+};
+
+static mutex_t mutex = MUTEX_INITIALIZER;
+static struct gro_flow flows[GRO_FLOW_SIZE];
+
+static struct ip_hdr *
+gro_flow_iphdr(struct gro_flow *flow)
+{
+    return (struct ip_hdr *)flow->buf;
+}
+
+static struct tcp_hdr *
+gro_flow_tcphdr(struct gro_flow *flow)
+{
+    return (struct tcp_hdr *)(gro_flow_iphdr(flow) + 1);
+}
+
+/*
+ * NOTE: The checksum of each segment is not verified here. The sum of each payload
+ *       is derived from its header and checksum field on the assumption that it is
+ *       correct, and the checksum of the merged segment is rebuilt from them.
+ *       So, if any of the merged segments is corrupted, the merged segment fails
+ *       the checksum verification in tcp_input() and the whole is dropped.
+ */
+static uint32_t
+gro_payload_sum(struct ip_hdr *iphdr, struct tcp_hdr *tcphdr, uint16_t tlen)
+{
+    struct pseudo_hdr pseudo;
+    uint16_t psum;
+
+    pseudo.src = iphdr->src;
+    pseudo.dst = iphdr->dst;
+    pseudo.zero = 0;
+    pseudo.protocol = IP_PROTOCOL_TCP;
+    pseudo.len = hton16(tlen);
+    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+    return cksum16((uint16_t *)tcphdr, (tcphdr->off >> 4) << 2, psum);
+}
+
+/*
+ * NOTE: must be called after mutex locked, it is unlocked while delivering
+ *       (the delivery may reach gro_receive() again, e.g. through the loopback)
+ */
+static void
+gro_flow_flush(struct gro_flow *flow)
+{
+    struct ip_hdr *iphdr;
+    struct tcp_hdr *tcphdr;
+    struct pseudo_hdr pseudo;
+    uint16_t psum;
+
+    if (flow->segs > 1) {
+        iphdr = gro_flow_iphdr(flow);
+        iphdr->total = hton16(flow->len);
+        iphdr->sum = 0;
+        iphdr->sum = cksum16((uint16_t *)iphdr, sizeof(*iphdr), 0);
+        tcphdr = gro_flow_tcphdr(flow);
+        pseudo.src = iphdr->src;
+        pseudo.dst = iphdr->dst;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_TCP;
+        pseudo.len = hton16(flow->len - sizeof(*iphdr));
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        tcphdr->sum = 0;
+        tcphdr->sum = cksum16((uint16_t *)tcphdr, (tcphdr->off >> 4) << 2, psum + flow->psum);
+        debugf("dev=%s, segs=%u, len=%zu", flow->dev->name, flow->segs, flow->len);
+    }
+    flow->state = GRO_FLOW_STATE_FLUSHING;
+    mutex_unlock(&mutex);
+    flow->deliver(NET_PROTOCOL_TYPE_IP, flow->buf, flow->len, flow->dev);
+    mutex_lock(&mutex);
+    flow->state = GRO_FLOW_STATE_FREE;
+}
+
+static struct gro_flow *
+gro_flow_select(struct net_device *dev, struct ip_hdr *iphdr, struct tcp_hdr *tcphdr)
+{
+    struct gro_flow *flow;
+
+    for (flow = flows; flow < tailof(flows); flow++) {
+        if (flow->state == GRO_FLOW_STATE_HELD && flow->dev == dev &&
+            gro_flow_iphdr(flow)->src == iphdr->src && gro_flow_iphdr(flow)->dst == iphdr->dst &&
+            gro_flow_tcphdr(flow)->src == tcphdr->src && gro_flow_tcphdr(flow)->dst == tcphdr->dst) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: returns NULL if all slots are being delivered by the other threads */
+static struct gro_flow *
+gro_flow_alloc(void)
+{
+    static unsigned int victim;
+    struct gro_flow *flow;
+    unsigned int i;
+
+    for (flow = flows; flow < tailof(flows); flow++) {
+        if (flow->state == GRO_FLOW_STATE_FREE) {
+            return flow;
+        }
+    }
+    /* all slots are in use, flush one of them */
+    for (i = 0; i < countof(flows); i++) {
+        flow = &flows[victim++ % countof(flows)];
+        if (flow->state == GRO_FLOW_STATE_HELD) {
+            gro_flow_flush(flow);
+            /* NOTE: the slot may be taken while the mutex is unlocked */
+            if (flow->state == GRO_FLOW_STATE_FREE) {
+                return flow;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int
+gro_flow_mergeable(struct gro_flow *flow, struct ip_hdr *iphdr, struct tcp_hdr *tcphdr, uint16_t hlen, uint16_t plen)
+{
+    struct ip_hdr *held_iphdr;
+    struct tcp_hdr *held_tcphdr;
+
+    held_iphdr = gro_flow_iphdr(flow);
+    held_tcphdr = gro_flow_tcphdr(flow);
+    if (ntoh32(tcphdr->seq) != flow->next) {
+        return 0;
+    }
+    if (tcphdr->ack != held_tcphdr->ack || tcphdr->wnd != held_tcphdr->wnd || tcphdr->off != held_tcphdr->off) {
+        return 0;
+    }
+    /* options (e.g. timestamps) must be identical */
+    if (memcmp(tcphdr + 1, held_tcphdr + 1, hlen - sizeof(*iphdr) - sizeof(*tcphdr)) != 0) {
+        return 0;
+    }
+    if (iphdr->tos != held_iphdr->tos || iphdr->ttl != held_iphdr->ttl) {
+        return 0;
+    }
+    if ((flow->len - hlen) % 2) {
+        /* the payloads are summed in 16-bit words, it must be appended at an even offset */
+        return 0;
+    }
+    if (flow->len + plen > sizeof(flow->buf) || flow->segs >= GRO_SEGS_MAX) {
+        return 0;
+    }
+    return 1;
+}
+
+int
+gro_receive(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int (*deliver)(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev))
+{
+    struct ip_hdr *iphdr;
+    struct tcp_hdr *tcphdr;
+    uint16_t total, hlen, plen;
+    struct gro_flow *flow;
+
+    if (type != NET_PROTOCOL_TYPE_IP || len < sizeof(*iphdr) + sizeof(*tcphdr)) {
+        return GRO_NORMAL;
+    }
+    iphdr = (struct ip_hdr *)data;
+    if (iphdr->vhl != ((IP_VERSION_IPV4 << 4) | (sizeof(*iphdr) >> 2)) || iphdr->protocol != IP_PROTOCOL_TCP) {
+        /* without IP options only */
+        return GRO_NORMAL;
+    }
+    total = ntoh16(iphdr->total);
+    if (total > len || ntoh16(iphdr->offset) & 0x3fff || cksum16((uint16_t *)iphdr, sizeof(*iphdr), 0) != 0) {
+        /* leave the error handling to ip_input() */
+        return GRO_NORMAL;
+    }
+    tcphdr = (struct tcp_hdr *)(iphdr + 1);
+    hlen = sizeof(*iphdr) + ((tcphdr->off >> 4) << 2);
+    if (hlen < sizeof(*iphdr) + sizeof(*tcphdr) || hlen > total) {
+        return GRO_NORMAL;
+    }
+    plen = total - hlen;
+    mutex_lock(&mutex);
+    flow = gro_flow_select(dev, iphdr, tcphdr);
+    if (!plen || (tcphdr->flg & 0x3f & ~GRO_TCP_FLG_PSH) != GRO_TCP_FLG_ACK) {
+        /* not mergeable, deliver the held segment first to keep the order */
+        if (flow) {
+            gro_flow_flush(flow);
+        }
+        mutex_unlock(&mutex);
+        return GRO_NORMAL;
+    }
+    if (flow) {
+        if (gro_flow_mergeable(flow, iphdr, tcphdr, hlen, plen)) {
+            memcpy(flow->buf + flow->len, data + hlen, plen);
+            flow->len += plen;
+            flow->psum += gro_payload_sum(iphdr, tcphdr, total - sizeof(*iphdr));
+            flow->next += plen;
+            flow->segs++;
+            gro_flow_tcphdr(flow)->flg |= tcphdr->flg; /* carry PSH */
+            mutex_unlock(&mutex);
+            return GRO_HELD;
+        }
+        gro_flow_flush(flow);
+    }
+    flow = gro_flow_alloc();
+    if (!flow) {
+        mutex_unlock(&mutex);
+        return GRO_NORMAL;
+    }
+    flow->state = GRO_FLOW_STATE_HELD;
+    flow->dev = dev;
+    flow->deliver = deliver;
+    memcpy(flow->buf, data, total);
+    flow->len = total;
+    flow->psum = gro_payload_sum(iphdr, tcphdr, total - sizeof(*iphdr));
+    flow->next = ntoh32(tcphdr->seq) + plen;
+    flow->segs = 1;
+    mutex_unlock(&mutex);
+    return GRO_HELD;
+}
+
+void
+gro_flush(void)
+{
+    struct gro_flow *flow;
+
+    mutex_lock(&mutex);
+    for (flow = flows; flow < tailof(flows); flow++) {
+        if (flow->state == GRO_FLOW_STATE_HELD) {
+            gro_flow_flush(flow);
+        }
+    }
+    mutex_unlock(&mutex);
+}
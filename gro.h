@@ -0,0 +1,17 @@
+#ifndef GRO_H
+#define GRO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+#define GRO_HELD    1 /* held (or merged) by GRO, the caller must not deliver it */
+#define GRO_NORMAL  0 /* not mergeable, the caller should deliver it as usual */
+
+extern int
+gro_receive(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev, int (*deliver)(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev));
+extern void
+gro_flush(void);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "gso.h"
+
+/*
+ * Generic Segmentation Offload (GSO)
+ *
+ * The transport layer builds one large segment (super-segment) and it goes
+ * down through the IP layer at once. It is split into frames which fit in
+ * the MTU just before it is passed to the device, and the headers are
+ * replicated and patched for each frame.
+ *
+ * NOTE: The transport checksum of a super-segment is not computed by the
+ *       sender; it is computed here for each frame (like checksum offload).
+ * NOTE: The frames are built in place; the headers of each frame are written
+ *       over the tail of the payload of the previous one, which is already
+ *       transmitted (net_device_output() does not refer to the data after it
+ *       returns). So the super-segment is destroyed by gso_output().
+ */
+
+#define GSO_HDR_SIZE_MAX (IP_HDR_SIZE_MAX + 60) /* IP + TCP (with options) */
+
+#define GSO_TCP_FLG_FIN 0x01
+#define GSO_TCP_FLG_PSH 0x08
+
+struct ip_hdr {
+    uint8_t vhl;
+    uint8_t tos;
+    uint16_t total;
+    uint16_t id;
+    uint16_t offset;
+    uint8_t ttl;
+    uint8_t protocol;
+    uint16_t sum;
+    ip_addr_t src;
+    ip_addr_t dst;
+};
+
+struct pseudo_hdr {
+    uint32_t src;
+    uint32_t dst;
+    uint8_t zero;
+    uint8_t protocol;
+    uint16_t len;
+};
+
+struct tcp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t off;
+    uint8_t flg;
+    uint16_t wnd;
+    uint16_t sum;
+    uint16_t up;
+};
+
+struct udp_hdr {
+    uint16_t src;
+    uint16_t dst;
+    uint16_t len;
+    uint16_t sum;
+};
+
+static uint16_t
+gso_pseudo_sum(struct ip_hdr *iphdr, uint16_t len)
+{
+    struct pseudo_hdr pseudo;
+
+    pseudo.src = iphdr->src;
+    pseudo.dst = iphdr->dst;
+    pseudo.zero = 0;
+    pseudo.protocol = iphdr->protocol;
+    pseudo.len = hton16(len);
+    return ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+}
+
+/*
+ * NOTE: buf holds the headers (hlen bytes) copied from the super-segment and
+ *       the payload of the frame, this function patches the headers for the
+ *       frame at the offset of the payload.
+ */
+static void
+gso_patch_headers(uint8_t *buf, uint16_t iphlen, uint16_t hlen, uint16_t id, size_t offset, uint16_t plen, int last)
+{
+    struct ip_hdr *iphdr;
+    struct tcp_hdr *tcphdr;
+    struct udp_hdr *udphdr;
+    uint16_t psum;
+
+    iphdr = (struct ip_hdr *)buf;
+    iphdr->total = hton16(hlen + plen);
+    iphdr->id = hton16(id);
+    iphdr->sum = 0;
+    iphdr->sum = cksum16((uint16_t *)iphdr, iphlen, 0);
+    psum = gso_pseudo_sum(iphdr, hlen - iphlen + plen);
+    switch (iphdr->protocol) {
+    case IP_PROTOCOL_TCP:
+        tcphdr = (struct tcp_hdr *)(buf + iphlen);
+        tcphdr->seq = hton32(ntoh32(tcphdr->seq) + offset);
+        if (!last) {
+            /* FIN and PSH belong to the last frame only */
+            tcphdr->flg &= ~(GSO_TCP_FLG_FIN | GSO_TCP_FLG_PSH);
+        }
+        tcphdr->sum = 0;
+        tcphdr->sum = cksum16((uint16_t *)tcphdr, hlen - iphlen + plen, psum);
+        break;
+    case IP_PROTOCOL_UDP:
+        /* each frame is an independent datagram (like UDP_SEGMENT) */
+        udphdr = (struct udp_hdr *)(buf + iphlen);
+        udphdr->len = hton16(sizeof(*udphdr) + plen);
+        udphdr->sum = 0;
+        udphdr->sum = cksum16((uint16_t *)udphdr, sizeof(*udphdr) + plen, psum);
+        if (!udphdr->sum) {
+            udphdr->sum = 0xffff; /* zero means "no checksum" */
+        }
+        break;
+    }
+}
+
+int
+gso_output(struct net_device *dev, uint16_t type, uint8_t *data, size_t len, const void *dst, uint16_t gso_size)
+{
+    uint8_t hdrs[GSO_HDR_SIZE_MAX];
+    uint8_t *frame;
+    struct ip_hdr *iphdr;
+    uint16_t total, iphlen, hlen, id, plen;
+    size_t payload, offset;
+    unsigned int segs, i;
+
+    if (!gso_size || type != NET_PROTOCOL_TYPE_IP) {
+        return net_device_output(dev, type, data, len, dst);
+    }
+    if (len < sizeof(*iphdr)) {
+        errorf("too short");
+        return -1;
+    }
+    iphdr = (struct ip_hdr *)data;
+    iphlen = (iphdr->vhl & 0x0f) << 2;
+    total = ntoh16(iphdr->total);
+    if (total > len || iphlen < sizeof(*iphdr) || iphlen > total) {
+        errorf("invalid IP header");
+        return -1;
+    }
+    switch (iphdr->protocol) {
+    case IP_PROTOCOL_TCP:
+        if (total < iphlen + sizeof(struct tcp_hdr)) {
+            errorf("too short");
+            return -1;
+        }
+        hlen = iphlen + ((((struct tcp_hdr *)(data + iphlen))->off >> 4) << 2);
+        break;
+    case IP_PROTOCOL_UDP:
+        hlen = iphlen + sizeof(struct udp_hdr);
+        break;
+    default:
+        errorf("unsupported protocol: %s(0x%02x)", ip_protocol_name(iphdr->protocol), iphdr->protocol);
+        return -1;
+    }
+    if (hlen > total) {
+        errorf("too short");
+        return -1;
+    }
+    if (hlen + gso_size > dev->mtu) {
+        errorf("too large gso_size, dev=%s, mtu=%u, gso_size=%u", dev->name, dev->mtu, gso_size);
+        return -1;
+    }
+    payload = total - hlen;
+    segs = payload ? (payload + gso_size - 1) / gso_size : 1;
+    if (segs > GSO_SEGS_MAX) {
+        errorf("too many segments, dev=%s, segs=%u", dev->name, segs);
+        return -1;
+    }
+    debugf("dev=%s, len=%u, gso_size=%u, segs=%u", dev->name, total, gso_size, segs);
+    id = ntoh16(iphdr->id);
+    memcpy(hdrs, data, hlen);
+    for (i = 0, offset = 0; i < segs; i++, offset += plen) {
+        plen = MIN(gso_size, payload - offset);
+        /* the hlen bytes in front of the payload of this frame */
+        frame = data + offset;
+        memcpy(frame, hdrs, hlen);
+        gso_patch_headers(frame, iphlen, hlen, id + i, offset, plen, i == segs - 1);
+        if (net_device_output(dev, type, frame, hlen + plen, dst) == -1) {
+            errorf("net_device_output() failure, dev=%s, seg=%u/%u", dev->name, i + 1, segs);
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef GSO_H
+#define GSO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+#define GSO_SEGS_MAX 44 /* maximum number of frames split from a super-segment */
+
+extern int
+gso_output(struct net_device *dev, uint16_t type, uint8_t *data, size_t len, const void *dst, uint16_t gso_size);
+
+#endif
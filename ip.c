@@ -9,6 +9,8 @@
 #include "net.h"
 #include "arp.h"
 #include "ip.h"
+#include "gro.h"
+#include "gso.h"
 
 struct ip_protocol {
     struct ip_protocol *next;
@@ -17,12 +19,38 @@ struct ip_protocol {
     void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
 };
 
+/*
+ * NOTE: lookup() tells whether the flow is known and fills its endpoint, input() processes the packet
+ *       with the endpoint found (flow is NULL if the packet was held by GRO, input() looks it up again)
+ */
+struct ip_early_demux {
+    int (*lookup)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_early_flow *flow);
+    int (*input)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_early_flow *flow);
+};
+
+#define IP_ROUTE_NEXTHOP_MAX 8
+
+struct ip_route_nexthop {
+    ip_addr_t addr;
+    struct ip_iface *iface;
+    unsigned int weight;
+};
+
 struct ip_route {
     struct ip_route *next;
     ip_addr_t network;
     ip_addr_t netmask;
-    ip_addr_t nexthop;
-    struct ip_iface *iface;
+    struct ip_route_nexthop nexthops[IP_ROUTE_NEXTHOP_MAX]; /* equal-cost multipath */
+    unsigned int num; /* number of nexthops */
+};
+
+/* NOTE: used as a key of the flow hash */
+struct ip_flow {
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t protocol;
 };
 
 struct ip_hdr {
@@ -46,6 +74,7 @@ const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 static struct ip_iface *ifaces;
 static struct ip_protocol *protocols;
 static struct ip_route *routes;
+static struct ip_early_demux early_demuxes[UINT8_MAX+1]; /* indexed by the protocol number */
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -149,31 +178,57 @@ ip_dump(const uint8_t *data, size_t len)
 
 /* NOTE: must not be call after net_run() */
 static struct ip_route *
-ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
+ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface, unsigned int weight)
 {
     struct ip_route *route;
+    struct ip_route_nexthop *nh;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
-    route = memory_alloc(sizeof(*route));
+    if (!weight) {
+        errorf("weight must be greater than zero");
+        return NULL;
+    }
+    for (route = routes; route; route = route->next) {
+        if (route->network == network && route->netmask == netmask) {
+            /* same prefix, add as an another path */
+            break;
+        }
+    }
     if (!route) {
-        errorf("memory_alloc() failure");
+        route = memory_alloc(sizeof(*route));
+        if (!route) {
+            errorf("memory_alloc() failure");
+            return NULL;
+        }
+        route->network = network;
+        route->netmask = netmask;
+        route->next = routes;
+        routes = route;
+    }
+    for (nh = route->nexthops; nh < route->nexthops + route->num; nh++) {
+        if (nh->addr == nexthop && nh->iface == iface) {
+            errorf("already exists, nexthop=%s, iface=%s",
+                ip_addr_ntop(nexthop, addr1, sizeof(addr1)), ip_addr_ntop(iface->unicast, addr2, sizeof(addr2)));
+            return NULL;
+        }
+    }
+    if (route->num == countof(route->nexthops)) {
+        errorf("too many nexthops, network=%s", ip_addr_ntop(network, addr1, sizeof(addr1)));
         return NULL;
     }
-    route->network = network;
-    route->netmask = netmask;
-    route->nexthop = nexthop;
-    route->iface = iface;
-    route->next = routes;
-    routes = route;
-    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
+    nh = &route->nexthops[route->num++];
+    nh->addr = nexthop;
+    nh->iface = iface;
+    nh->weight = weight;
+    infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s, weight=%u (paths: %u)",
         ip_addr_ntop(route->network, addr1, sizeof(addr1)),
         ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
-        ip_addr_ntop(route->nexthop, addr3, sizeof(addr3)),
-        ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
-        NET_IFACE(iface)->dev->name
+        ip_addr_ntop(nh->addr, addr3, sizeof(addr3)),
+        ip_addr_ntop(nh->iface->unicast, addr4, sizeof(addr4)),
+        NET_IFACE(iface)->dev->name, nh->weight, route->num
     );
     return route;
 }
@@ -193,33 +248,136 @@ ip_route_lookup(ip_addr_t dst)
     return candidate;
 }
 
+/*
+ * Select one of the nexthops by the flow hash (weighted).
+ * The same flow always takes the same path, so that the packets are kept in order.
+ * If src is specified, only the paths that can send with that address are eligible.
+ */
+static struct ip_route_nexthop *
+ip_route_select(struct ip_route *route, ip_addr_t src, uint32_t hash)
+{
+    struct ip_route_nexthop *nh;
+    unsigned int total = 0, point;
+
+    for (nh = route->nexthops; nh < route->nexthops + route->num; nh++) {
+        if (src == IP_ADDR_ANY || src == nh->iface->unicast) {
+            total += nh->weight;
+        }
+    }
+    if (!total) {
+        return NULL;
+    }
+    point = hash % total;
+    for (nh = route->nexthops; nh < route->nexthops + route->num; nh++) {
+        if (src == IP_ADDR_ANY || src == nh->iface->unicast) {
+            if (point < nh->weight) {
+                break;
+            }
+            point -= nh->weight;
+        }
+    }
+    return nh;
+}
+
+static uint32_t
+ip_flow_hash(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+    struct ip_flow flow;
+
+    memset(&flow, 0, sizeof(flow)); /* NOTE: the padding is hashed as well */
+    flow.src = src;
+    flow.dst = dst;
+    flow.protocol = protocol;
+    switch (protocol) {
+    case IP_PROTOCOL_TCP:
+    case IP_PROTOCOL_UDP:
+        /* NOTE: both TCP and UDP have the source/destination ports at the beginning of the header */
+        if (len >= sizeof(flow.sport) + sizeof(flow.dport)) {
+            memcpy(&flow.sport, data, sizeof(flow.sport));
+            memcpy(&flow.dport, data + sizeof(flow.sport), sizeof(flow.dport));
+        }
+        break;
+    }
+    return hash32(&flow, sizeof(flow), 0);
+}
+
 /* NOTE: must not be call after net_run() */
 int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
 {
-    ip_addr_t gw;
+    return ip_route_add_gateway(iface, "0.0.0.0", "0.0.0.0", gateway, IP_ROUTE_WEIGHT_DEFAULT);
+}
 
+/* NOTE: must not be call after net_run() */
+int
+ip_route_add_gateway(struct ip_iface *iface, const char *network, const char *netmask, const char *gateway, unsigned int weight)
+{
+    ip_addr_t net, mask, gw;
+
+    if (ip_addr_pton(network, &net) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", network);
+        return -1;
+    }
+    if (ip_addr_pton(netmask, &mask) == -1) {
+        errorf("ip_addr_pton() failure, addr=%s", netmask);
+        return -1;
+    }
     if (ip_addr_pton(gateway, &gw) == -1) {
         errorf("ip_addr_pton() failure, addr=%s", gateway);
         return -1;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
+    if (!ip_route_add(net & mask, mask, gw, iface, weight)) {
         errorf("ip_route_add() failure");
         return -1;
     }
     return 0;
 }
 
+/* NOTE: with multipath, the path is selected by the destination address only (use ip_route_get_iface_flow() to select the source address of a flow) */
 struct ip_iface *
 ip_route_get_iface(ip_addr_t dst)
 {
     struct ip_route *route;
+    struct ip_route_nexthop *nh;
 
     route = ip_route_lookup(dst);
     if (!route) {
         return NULL;
     }
-    return route->iface;
+    nh = ip_route_select(route, IP_ADDR_ANY, hash32(&dst, sizeof(dst), 0));
+    if (!nh) {
+        return NULL;
+    }
+    return nh->iface;
+}
+
+/*
+ * NOTE: with multipath, the path is selected by the flow hash (the source address is not decided yet),
+ *       so that the flows to the same destination are spread across the paths
+ * NOTE: the ports are in network byte order
+ */
+struct ip_iface *
+ip_route_get_iface_flow(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport)
+{
+    struct ip_route *route;
+    struct ip_route_nexthop *nh;
+    struct ip_flow flow;
+
+    route = ip_route_lookup(dst);
+    if (!route) {
+        return NULL;
+    }
+    memset(&flow, 0, sizeof(flow)); /* NOTE: the padding is hashed as well */
+    flow.src = IP_ADDR_ANY;
+    flow.dst = dst;
+    flow.sport = sport;
+    flow.dport = dport;
+    flow.protocol = protocol;
+    nh = ip_route_select(route, IP_ADDR_ANY, hash32(&flow, sizeof(flow), 0));
+    if (!nh) {
+        return NULL;
+    }
+    return nh->iface;
 }
 
 struct ip_iface *
@@ -259,7 +417,7 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
         errorf("net_device_add_iface() failure");
         return -1;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
+    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface, IP_ROUTE_WEIGHT_DEFAULT)) {
         errorf("ip_route_add() failure");
         return -1;
     }
@@ -349,7 +507,83 @@ ip_input(const uint8_t *data, size_t len, struct net_device *dev)
 }
 
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_early_deliver(const uint8_t *data, size_t len, struct net_device *dev, const struct ip_early_flow *flow)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen, total;
+
+    hdr = (struct ip_hdr *)data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    total = ntoh16(hdr->total);
+    if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
+        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
+        return 0;
+    }
+    debugf("dev=%s, protocol=%s(0x%02x), len=%u", dev->name, ip_protocol_name(hdr->protocol), hdr->protocol, total);
+    ip_dump(data, total);
+    if (early_demuxes[hdr->protocol].input((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, flow) == -1) {
+        /* the flow has gone away in the meantime, take the generic path */
+        ip_input(data, len, dev);
+    }
+    return 0;
+}
+
+/* NOTE: the delivery of the segments merged by GRO */
+static int
+ip_early_input(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+{
+    return ip_early_deliver(data, len, dev, NULL);
+}
+
+/*
+ * NOTE: The packets of a flow known to the upper protocol skip the input queue,
+ *       the iface lookup and the protocol dispatch. The flow is identified by
+ *       the addresses in the packet, so the destination must be our address.
+ */
+static int
+ip_early_demux(const uint8_t *data, size_t len, struct net_device *dev)
+{
+    struct ip_hdr *hdr;
+    uint16_t hlen, total;
+    struct ip_iface *iface;
+    struct ip_early_demux *early;
+    struct ip_early_flow flow;
+
+    if (len < IP_HDR_SIZE_MIN) {
+        return -1;
+    }
+    hdr = (struct ip_hdr *)data;
+    if ((hdr->vhl >> 4) != IP_VERSION_IPV4) {
+        return -1;
+    }
+    hlen = (hdr->vhl & 0x0f) << 2;
+    total = ntoh16(hdr->total);
+    if (hlen < IP_HDR_SIZE_MIN || total < hlen || len < total || ntoh16(hdr->offset) & 0x3fff) {
+        /* leave the error handling to ip_input() */
+        return -1;
+    }
+    early = &early_demuxes[hdr->protocol];
+    if (!early->lookup) {
+        return -1;
+    }
+    iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (!iface || hdr->dst != iface->unicast) {
+        /* NOTE: the same as ip_input(), the address must belong to the receiving device */
+        return -1;
+    }
+    if (early->lookup((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, &flow) == -1) {
+        return -1;
+    }
+    if (gro_receive(NET_PROTOCOL_TYPE_IP, data, len, dev, ip_early_input) == GRO_HELD) {
+        /* NOTE: raise to flush the held segments at the end of this batch */
+        raise_softirq();
+        return 0;
+    }
+    return ip_early_deliver(data, len, dev, &flow);
+}
+
+static int
+ip_output_device(struct ip_iface *iface, uint8_t *data, size_t len, ip_addr_t dst, uint16_t gso_size)
 {
     uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
     int ret;
@@ -358,24 +592,26 @@ ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_add
         if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
             memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
         } else {
-            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
+            /* NOTE: the packet is held until the address is resolved */
+            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr, data, len, gso_size);
             if (ret != ARP_RESOLVE_FOUND) {
                 return ret;
             }
         }
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    /* NOTE: the neighbor is resolved only once even for a super-segment */
+    return gso_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr, gso_size);
 }
 
+/* NOTE: the header is built in the headroom (IP_OUTPUT_HEADROOM bytes) in front of the data */
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_iface *iface, uint8_t protocol, uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset, uint16_t gso_size)
 {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
     uint16_t hlen, total;
     char addr[IP_ADDR_STR_LEN];
 
-    hdr = (struct ip_hdr *)buf;
+    hdr = (struct ip_hdr *)(data - IP_OUTPUT_HEADROOM);
     hlen = sizeof(*hdr);
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
@@ -389,30 +625,61 @@ ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, si
     hdr->src = src;
     hdr->dst = dst;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert bytoder */
-    memcpy(hdr+1, data, len);
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+    ip_dump((uint8_t *)hdr, total);
+    return ip_output_device(iface, (uint8_t *)hdr, total, nexthop, gso_size);
 }
 
+/* NOTE: reserve consecutive IDs for the frames split from a super-segment */
 static uint16_t
-ip_generate_id(void)
+ip_generate_id(uint16_t count)
 {
     static mutex_t mutex = MUTEX_INITIALIZER;
     static uint16_t id = 128;
     uint16_t ret;
 
     mutex_lock(&mutex);
-    ret = id++;
+    ret = id;
+    id += count;
     mutex_unlock(&mutex);
     return ret;
 }
 
 ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+{
+    return ip_output_gso(protocol, data, len, src, dst, 0);
+}
+
+/*
+ * NOTE: If gso_size is not zero, the data is a super-segment which is split
+ *       into payloads of gso_size bytes by GSO (see gso.c), and the transport
+ *       checksum is left to GSO.
+ */
+ssize_t
+ip_output_gso(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t gso_size)
+{
+    uint8_t buf[IP_TOTAL_SIZE_MAX];
+
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
+        return -1;
+    }
+    memcpy(buf + IP_OUTPUT_HEADROOM, data, len);
+    return ip_output_headroom(protocol, buf + IP_OUTPUT_HEADROOM, len, src, dst, gso_size);
+}
+
+/*
+ * NOTE: Same as ip_output_gso() without copying the data; the caller must
+ *       reserve IP_OUTPUT_HEADROOM writable bytes in front of the data, and
+ *       the data is destroyed (the headers are built in place).
+ */
+ssize_t
+ip_output_headroom(uint8_t protocol, uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t gso_size)
 {
     struct ip_route *route;
+    struct ip_route_nexthop *nh;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     ip_addr_t nexthop;
@@ -427,19 +694,24 @@ ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_a
         errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
         return -1;
     }
-    iface = route->iface;
-    if (src != IP_ADDR_ANY && src != iface->unicast) {
+    nh = ip_route_select(route, src, ip_flow_hash(protocol, data, len, src, dst));
+    if (!nh) {
         errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
+    iface = nh->iface;
+    nexthop = (nh->addr != IP_ADDR_ANY) ? nh->addr : dst;
+    if (!gso_size && NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
         errorf("too long, dev=%s, mtu=%s, tatal=%zu",
             NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
         return -1;
     }
-    id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    if (len > IP_PAYLOAD_SIZE_MAX) {
+        errorf("too long, len=%zu", len);
+        return -1;
+    }
+    id = ip_generate_id(gso_size ? (len + gso_size - 1) / gso_size : 1);
+    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0, gso_size) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
@@ -472,6 +744,16 @@ ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+ip_protocol_register_early_demux(uint8_t type, int (*lookup)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_early_flow *flow), int (*input)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_early_flow *flow))
+{
+    early_demuxes[type].lookup = lookup;
+    early_demuxes[type].input = input;
+    infof("early demux registered, type=%s(0x%02x)", ip_protocol_name(type), type);
+    return 0;
+}
+
 char *
 ip_protocol_name(uint8_t type)
 {
@@ -492,5 +774,9 @@ ip_init(void)
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_protocol_register_early_demux(NET_PROTOCOL_TYPE_IP, ip_early_demux) == -1) {
+        errorf("net_protocol_register_early_demux() failure");
+        return -1;
+    }
     return 0;
 }
@@ -14,12 +14,15 @@
 
 #define IP_TOTAL_SIZE_MAX UINT16_MAX /* maximum value of uint16 */
 #define IP_PAYLOAD_SIZE_MAX (IP_TOTAL_SIZE_MAX - IP_HDR_SIZE_MIN)
+#define IP_OUTPUT_HEADROOM IP_HDR_SIZE_MIN /* see ip_output_headroom() */
 
 #define IP_ADDR_LEN 4
 #define IP_ADDR_STR_LEN 16 /* "ddd.ddd.ddd.ddd\0" */
 
 #define IP_ENDPOINT_STR_LEN (IP_ADDR_STR_LEN + 6) /* xxx.xxx.xxx.xxx:yyyyy\n */
 
+#define IP_ROUTE_WEIGHT_DEFAULT 1
+
 /* see https://www.iana.org/assignments/protocol-numbers/protocol-numbers.txt */
 #define IP_PROTOCOL_ICMP 0x01
 #define IP_PROTOCOL_TCP  0x06
@@ -32,6 +35,12 @@ struct ip_endpoint {
     uint16_t port;
 };
 
+/* NOTE: the endpoint of a flow found by the early lookup (opaque to the IP layer) */
+struct ip_early_flow {
+    int id;
+    unsigned int gen;
+};
+
 struct ip_iface {
     struct net_iface iface;
     struct ip_iface *next;
@@ -54,8 +63,12 @@ ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
+extern int
+ip_route_add_gateway(struct ip_iface *iface, const char *network, const char *netmask, const char *gateway, unsigned int weight);
 extern struct ip_iface *
 ip_route_get_iface(ip_addr_t dst);
+extern struct ip_iface *
+ip_route_get_iface_flow(uint8_t protocol, ip_addr_t dst, uint16_t sport, uint16_t dport);
 
 extern struct ip_iface *
 ip_iface_alloc(const char *addr, const char *netmask);
@@ -66,9 +79,15 @@ ip_iface_select(ip_addr_t addr);
 
 extern ssize_t
 ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+extern ssize_t
+ip_output_gso(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t gso_size);
+extern ssize_t
+ip_output_headroom(uint8_t protocol, uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, uint16_t gso_size);
 
 extern int
 ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+extern int
+ip_protocol_register_early_demux(uint8_t type, int (*lookup)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_early_flow *flow), int (*input)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_early_flow *flow));
 extern char *
 ip_protocol_name(uint8_t type);
 
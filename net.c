@@ -10,6 +10,7 @@
 
 #include "util.h"
 #include "net.h"
+#include "gro.h"
 
 struct net_protocol {
     struct net_protocol *next;
@@ -17,6 +18,7 @@ struct net_protocol {
     uint16_t type;
     struct queue_head queue; /* input queue */
     void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
+    int (*early_demux)(const uint8_t *data, size_t len, struct net_device *dev);
 };
 
 /* NOTE: the data follows immediately after the structure */
@@ -162,8 +164,8 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
     return 0;
 }
 
-int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+static int
+net_input_enqueue(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
 {
     struct net_protocol *proto;
     struct net_protocol_queue_entry *entry;
@@ -193,6 +195,39 @@ net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_dev
     return 0;
 }
 
+int
+net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+{
+    if (gro_receive(type, data, len, dev, net_input_enqueue) == GRO_HELD) {
+        /* NOTE: raise to flush the held segments at the end of this batch */
+        raise_softirq();
+        return 0;
+    }
+    return net_input_enqueue(type, data, len, dev);
+}
+
+/*
+ * NOTE: Early demux delivers a packet of a known flow directly from the device
+ *       poll, bypassing the input queue. It must be called only from the
+ *       interrupt context, so the protocol handler never runs in a thread
+ *       that already holds a lock of the protocols (e.g. via loopback).
+ */
+int
+net_input_early_demux(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            if (!proto->early_demux) {
+                break;
+            }
+            return proto->early_demux(data, len, dev);
+        }
+    }
+    return -1;
+}
+
 /* NOTE: must not be call after net_run() */
 int
 net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
@@ -219,6 +254,23 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+net_protocol_register_early_demux(uint16_t type, int (*early_demux)(const uint8_t *data, size_t len, struct net_device *dev))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->early_demux = early_demux;
+            infof("early demux registered, type=%s(0x%04x)", proto->name, type);
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
 char *
 net_protocol_name(uint16_t type)
 {
@@ -239,6 +291,7 @@ net_protocol_handler(void)
     struct net_protocol_queue_entry *entry;
     unsigned int num;
 
+    gro_flush();
     for (proto = protocols; proto; proto = proto->next) {
         while (1) {
             entry = queue_pop(&proto->queue);
@@ -329,10 +382,17 @@ net_event_handler(void)
     return 0;
 }
 
+#include "arp.h"
+#include "ip.h"
+#include "icmp.h"
+#include "udp.h"
+#include "tcp.h"
+
 int
 net_run(void)
 {
     struct net_device *dev;
+    struct net_iface *iface;
 
     if (intr_run() == -1) {
         errorf("intr_run() failure");
@@ -342,6 +402,16 @@ net_run(void)
     for (dev = devices; dev; dev = dev->next) {
         net_device_open(dev);
     }
+    for (dev = devices; dev; dev = dev->next) {
+        if (!NET_DEVICE_IS_UP(dev) || !(dev->flags & NET_DEVICE_FLAG_NEED_ARP)) {
+            continue;
+        }
+        for (iface = dev->ifaces; iface; iface = iface->next) {
+            if (iface->family == NET_IFACE_FAMILY_IP) {
+                arp_announce(iface);
+            }
+        }
+    }
     debugf("running...");
     return 0;
 }
@@ -358,12 +428,6 @@ net_shutdown(void)
     debugf("shutdown");
 }
 
-#include "arp.h"
-#include "ip.h"
-#include "icmp.h"
-#include "udp.h"
-#include "tcp.h"
-
 int
 net_init(void)
 {
@@ -85,9 +85,13 @@ net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, si
 
 extern int
 net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+extern int
+net_input_early_demux(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
 
 extern int
 net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+extern int
+net_protocol_register_early_demux(uint16_t type, int (*early_demux)(const uint8_t *data, size_t len, struct net_device *dev));
 extern char *
 net_protocol_name(uint16_t type);
 extern int
@@ -6,6 +6,7 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/types.h>
+#include <sys/random.h>
 #include <unistd.h>
 
 /*
@@ -24,6 +25,17 @@ memory_free(void *ptr)
     free(ptr);
 }
 
+/*
+ * Random
+ */
+
+/* NOTE: unpredictable bytes (e.g. for secret keys), not for the bulk use */
+static inline int
+random_bytes(void *buf, size_t len)
+{
+    return getrandom(buf, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
 /*
  * Mutex
  */
@@ -50,6 +62,51 @@ mutex_unlock(mutex_t *mutex)
     return pthread_mutex_unlock(mutex);
 }
 
+/*
+ * Seqlock
+ *
+ * NOTE: Writers must be serialized by a mutex. Readers take no lock, they
+ *       retry if a writer has run in the meantime, so the data read under
+ *       a seqlock must never be freed while readers may refer to it.
+ */
+
+typedef struct {
+    unsigned int seq;
+} seqlock_t;
+
+#define SEQLOCK_INITIALIZER {0}
+
+static inline unsigned int
+seqlock_read_begin(seqlock_t *sl)
+{
+    unsigned int seq;
+
+    while ((seq = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1) {
+        /* a writer is running */
+    }
+    return seq;
+}
+
+static inline int
+seqlock_read_retry(seqlock_t *sl, unsigned int seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline void
+seqlock_write_begin(seqlock_t *sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+seqlock_write_end(seqlock_t *sl)
+{
+    __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+}
+
 /*
  * Scheduler
  */
@@ -322,3 +322,128 @@ sock_send(int id, const void *buf, size_t n)
     }
     return -1;
 }
+
+/* NOTE: IPPROTO_TCP and IPPROTO_UDP are the same level, told apart by the type of the socket */
+static int
+sock_opt_tcp(int level, int optname)
+{
+    if (level == SOL_SOCKET) {
+        switch (optname) {
+        case SO_SNDBUF:
+            return TCP_OPT_SNDBUF;
+        case SO_RCVBUF:
+            return TCP_OPT_RCVBUF;
+        case SO_RCVLOWAT:
+            return TCP_OPT_RCVLOWAT;
+        }
+        return -1;
+    }
+    if (level == IPPROTO_TCP) {
+        switch (optname) {
+        case TCP_NODELAY:
+            return TCP_OPT_NODELAY;
+        case TCP_CORK:
+            return TCP_OPT_CORK;
+        case TCP_QUICKACK:
+            return TCP_OPT_QUICKACK;
+        case TCP_CONGESTION:
+            return TCP_OPT_CONGESTION;
+        }
+    }
+    return -1;
+}
+
+static int
+sock_opt_udp(int level, int optname)
+{
+    if (level == SOL_SOCKET) {
+        switch (optname) {
+        case SO_RCVBUF:
+            return UDP_OPT_RCVBUF;
+        }
+        /* NOTE: no send buffer (a datagram is sent at once), no low-water mark */
+        return -1;
+    }
+    if (level == IPPROTO_UDP) {
+        switch (optname) {
+        case UDP_SEGMENT:
+            return UDP_OPT_SEGMENT;
+        }
+    }
+    return -1;
+}
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    int opt;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (optlen < 0) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        switch (s->type) {
+        case SOCK_STREAM:
+            opt = sock_opt_tcp(level, optname);
+            if (opt == -1) {
+                return -1;
+            }
+            return tcp_setopt(s->desc, opt, optval, optlen);
+        case SOCK_DGRAM:
+            opt = sock_opt_udp(level, optname);
+            if (opt == -1) {
+                return -1;
+            }
+            return udp_setopt(s->desc, opt, optval, optlen);
+        }
+        return -1;
+    }
+    return -1;
+}
+
+int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen)
+{
+    struct sock *s;
+    int opt, ret = -1;
+    size_t len;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (*optlen < 0) {
+        return -1;
+    }
+    len = *optlen;
+    switch (s->family) {
+    case AF_INET:
+        switch (s->type) {
+        case SOCK_STREAM:
+            opt = sock_opt_tcp(level, optname);
+            if (opt == -1) {
+                return -1;
+            }
+            ret = tcp_getopt(s->desc, opt, optval, &len);
+            break;
+        case SOCK_DGRAM:
+            opt = sock_opt_udp(level, optname);
+            if (opt == -1) {
+                return -1;
+            }
+            ret = udp_getopt(s->desc, opt, optval, &len);
+            break;
+        }
+        break;
+    }
+    if (ret != -1) {
+        *optlen = len;
+    }
+    return ret;
+}
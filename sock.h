@@ -24,6 +24,22 @@
 
 #define INADDR_ANY ((ip_addr_t)0)
 
+#define SOL_SOCKET 1
+
+/* level: SOL_SOCKET */
+#define SO_SNDBUF    7 /* int: size of the send buffer (stream only, before the connection is opened) */
+#define SO_RCVBUF    8 /* int: size of the receive buffer (before the connection is opened if stream) */
+#define SO_RCVLOWAT 18 /* int: bytes to wake up the reader (stream only) */
+
+/* level: IPPROTO_TCP (stream socket) */
+#define TCP_NODELAY     1 /* int: disable Nagle's algorithm */
+#define TCP_CORK        3 /* int: hold partial segments until it is cleared */
+#define TCP_QUICKACK   12 /* int: disable the delayed ACK */
+#define TCP_CONGESTION 13 /* string: name of the congestion control algorithm */
+
+/* level: IPPROTO_UDP (datagram socket) */
+#define UDP_SEGMENT 103 /* int: split a large datagram into datagrams of this size by GSO */
+
 #define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
 
 struct sock {
@@ -71,5 +87,9 @@ extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
+extern int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen);
 
 #endif
@@ -1,16 +1,21 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "gso.h"
 #include "tcp.h"
+#include "tcp_cc.h"
 
 #define TCP_FLG_FIN 0x01
 #define TCP_FLG_SYN 0x02
@@ -22,7 +27,55 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
-#define TCP_PCB_SIZE 16
+/* NOTE: sequence number comparison with the wraparound */
+#define TCP_SEQ_LT(x, y) ((int32_t)((x) - (y)) < 0)
+#define TCP_SEQ_LEQ(x, y) ((int32_t)((x) - (y)) <= 0)
+#define TCP_SEQ_MAX(x, y) (TCP_SEQ_LT(x, y) ? (y) : (x))
+
+#ifndef TCP_PCB_SIZE_MAX
+#define TCP_PCB_SIZE_MAX 131072 /* maximum number of PCBs */
+#endif
+#define TCP_PCB_CHUNK_SIZE 64 /* number of PCBs allocated at once */
+
+#ifndef TCP_SYNQ_SIZE
+#define TCP_SYNQ_SIZE 1024 /* half-open connections of all the listeners (power of 2) */
+#endif
+#define TCP_BACKLOG_MAX 4096 /* upper bound of the accept queue (SOMAXCONN of Linux) */
+
+#ifndef TCP_RCVBUF_SIZE_DEFAULT
+#define TCP_RCVBUF_SIZE_DEFAULT 131072
+#endif
+#define TCP_RCVBUF_SIZE_MIN 536
+#define TCP_RCVBUF_SIZE_MAX (4 * 1024 * 1024) /* NOTE: beyond 65535 only with the window scale option */
+
+#ifndef TCP_SNDBUF_SIZE_DEFAULT
+#define TCP_SNDBUF_SIZE_DEFAULT 65536
+#endif
+#define TCP_SNDBUF_SIZE_MIN 536
+#define TCP_SNDBUF_SIZE_MAX (4 * 1024 * 1024)
+
+#define TCP_RANGE_MAX 64 /* ranges of out-of-order/SACKed data tracked at once */
+
+#define TCP_OPTION_EOL       0
+#define TCP_OPTION_NOP       1
+#define TCP_OPTION_MSS       2
+#define TCP_OPTION_WSCALE    3
+#define TCP_OPTION_SACK_PERM 4
+#define TCP_OPTION_SACK      5
+#define TCP_OPTION_TIMESTAMP 8
+#define TCP_OPTION_TIMESTAMP_SPACE 12 /* NOTE: padded with NOP */
+#define TCP_OPTION_SPACE_MAX 40
+#define TCP_SACK_BLOCK_MAX 4 /* NOTE: limited by the option space */
+#define TCP_SBUF_IOV_MAX 16 /* NOTE: pieces of the send buffer in a segment */
+#define TCP_WSCALE_MAX 14 /* rfc7323 - section 2.3 */
+#define TCP_PAWS_IDLE (24 * 24 * 60 * 60 * 1000U) /* milli seconds (rfc7323 - section 5.5) */
+
+#define TCP_HASH_CONN   0 /* connections indexed by 4-tuple */
+#define TCP_HASH_LISTEN 1 /* listeners indexed by local address/port */
+#define TCP_HASH_BIND   2 /* PCBs holding a local port indexed by the port */
+#define TCP_HASH_NUM    3
+
+#define TCP_HASH_SIZE_MIN 64
 
 #define TCP_PCB_MODE_RFC793 1
 #define TCP_PCB_MODE_SOCKET 2
@@ -40,12 +93,45 @@
 #define TCP_PCB_STATE_CLOSE_WAIT  10
 #define TCP_PCB_STATE_LAST_ACK    11
 
-#define TCP_DEFAULT_RTO 200000 /* micro seconds */
+#define TCP_PCB_FLG_NODELAY  0x01 /* disable Nagle's algorithm */
+#define TCP_PCB_FLG_CORK     0x02 /* hold partial segments */
+#define TCP_PCB_FLG_MORE     0x04 /* the last write announced more data (TCP_MSG_MORE) */
+#define TCP_PCB_FLG_FIN      0x08 /* FIN is queued behind the buffered data */
+#define TCP_PCB_FLG_FIN_SENT 0x10
+#define TCP_PCB_FLG_RECOVERY 0x20 /* fast recovery (RFC 6675, RFC 6582 without SACK) */
+#define TCP_PCB_FLG_LOSS     0x40 /* retransmitting the data sent before the timeout */
+#define TCP_PCB_FLG_SACK     0x80 /* SACK permitted by both ends (RFC 2018) */
+#define TCP_PCB_FLG_WSCALE   0x100 /* window scale option sent by the peer (RFC 7323) */
+#define TCP_PCB_FLG_QUICKACK 0x200 /* acknowledge every segment at once */
+#define TCP_PCB_FLG_PUSHACK  0x400 /* acknowledge a segment with PSH at once */
+#define TCP_PCB_FLG_TS       0x800 /* timestamps sent by the peer (RFC 7323) */
+
+#define TCP_FIN_ACKED(pcb, ack) (((pcb)->flags & TCP_PCB_FLG_FIN_SENT) && (ack) == (pcb)->snd.nxt)
+#define TCP_DEFAULT_MSS 536
+#define TCP_MIN_MSS 88 /* NOTE: the smallest MSS of the peer accepted, a smaller one is raised to it (like Linux) */
+#define TCP_TIMER_INTERVAL 10000 /* micro seconds, also the clock granularity of the RTO */
+#define TCP_TIMER_WHEEL_SIZE 512 /* slots of TCP_TIMER_INTERVAL (power of 2) */
+#define TCP_RTO_INITIAL 1000000 /* micro seconds (RFC 6298) */
+#ifndef TCP_RTO_MIN_DEFAULT
+#define TCP_RTO_MIN_DEFAULT 200000 /* micro seconds */
+#endif
+#define TCP_RTO_MAX 60000000 /* micro seconds */
+#define TCP_DUPTHRESH 3
+#define TCP_DELACK_TIMEOUT 40000 /* micro seconds (rfc1122 - section 4.2.3.2, less than 0.5 seconds) */
+#define TCP_DELACK_SEGS 2 /* full-sized segments acknowledged at once */
+#define TCP_PERSIST_TIMEOUT_MIN 200000 /* micro seconds, doubled on each probe */
+#define TCP_PERSIST_TIMEOUT_MAX 60000000 /* micro seconds */
 #define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
+#define TCP_SYNACK_RETRIES 5 /* retransmissions of the SYN-ACK of a half-open connection */
+#define TCP_SYNCOOKIE_PERIOD 64 /* seconds, a SYN cookie is valid for one or two periods */
+#define TCP_SYNCOOKIE_VALID (TCP_SYNCOOKIE_PERIOD * 2) /* seconds, cookies are accepted only this long after one is sent */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
 
+#define TCP_GSO_SIZE_MAX (IP_PAYLOAD_SIZE_MAX - sizeof(struct tcp_hdr))
+
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
+#define TCP_SOURCE_PORT_RANGE (TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN + 1)
 
 struct pseudo_hdr {
     uint32_t src;
@@ -67,15 +153,57 @@ struct tcp_hdr {
     uint16_t up;
 };
 
+struct tcp_sack_block {
+    uint32_t seq;
+    uint32_t end;
+};
+
 struct tcp_segment_info {
     uint32_t seq;
     uint32_t ack;
     uint16_t len;
-    uint16_t wnd;
+    uint32_t wnd; /* NOTE: scaled once the connection is known */
     uint16_t up;
+    uint16_t mss; /* 0: no MSS option */
+    int wscale_ok;
+    uint8_t wscale;
+    int ts_ok;
+    uint32_t tsval;
+    uint32_t tsecr;
+    int sack_perm;
+    int sack_num;
+    struct tcp_sack_block sack[TCP_SACK_BLOCK_MAX];
+};
+
+/* NOTE: a piece of the send buffer, in the order of the stream */
+struct tcp_sbuf_extent {
+    struct tcp_sbuf_extent *next;
+    const uint8_t *data; /* NULL: in the ring */
+    size_t len;
+    uint32_t notify; /* zero-copy sends completed with this extent (0: none) */
+};
+
+/* NOTE: an entry of a timer wheel, embedded in the object having the timers */
+struct tcp_timer_link {
+    struct tcp_timer_link *next;
+    struct tcp_timer_link *prev;
+    struct timeval due;
+    unsigned int slot;
+    int armed;
+};
+
+struct tcp_timer_wheel {
+    struct tcp_timer_link *slots[TCP_TIMER_WHEEL_SIZE];
+    uint64_t tick; /* the tick visited last */
 };
 
 struct tcp_pcb {
+    mutex_t mutex; /* NOTE: guards the members below, never reset while the pool exists */
+    int id;
+    unsigned int gen; /* incremented on release, tells the PCB looked up from the reused one */
+    uint8_t *kept; /* receive buffer freed while lent to the user, freed on the reuse */
+    struct tcp_timer_link timer; /* armed with the earliest timer of the PCB (guarded by timer_mutex) */
+    struct tcp_pcb *timer_batch; /* the due PCBs being handled by tcp_timer() */
     int state;
     int mode; /* user command mode */
     struct ip_endpoint local;
@@ -83,42 +211,189 @@ struct tcp_pcb {
     struct {
         uint32_t nxt;
         uint32_t una;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
+        uint8_t wscale; /* shift count of the window received */
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
+        uint32_t adv; /* window last advertised */
+        uint8_t wscale; /* shift count of the window sent */
     } rcv;
     uint32_t irs;
     uint16_t mtu;
     uint16_t mss;
-    uint8_t buf[65535]; /* receive buffer */
+    uint16_t peer_mss; /* MSS option of the peer (0: not received) */
+    struct {
+        uint8_t *data; /* allocated while the connection is established */
+        uint32_t size;
+        uint32_t head; /* read index */
+        uint32_t tail; /* write index */
+        uint32_t lent; /* bytes from head borrowed by the user (see tcp_receive_borrow()) */
+        uint32_t lowat; /* bytes to wake up the reader (0: any) */
+    } rbuf; /* receive buffer (ring, the used length is size - rcv.wnd) */
+    struct tcp_range *ooo; /* out-of-order data beyond rcv.nxt (sorted by seq) */
+    int ooo_num;
+    uint32_t ooo_recent; /* seq of the latest out-of-order segment (reported first in SACK) */
+    struct {
+        uint8_t *data; /* allocated while the connection is established */
+        uint32_t size;
+        uint32_t head; /* index of the data at snd.una */
+        uint32_t len; /* unacknowledged and unsent data (including the zero-copy data) */
+        uint32_t used; /* bytes in the ring */
+        struct tcp_sbuf_extent *extents; /* NULL: all the data is in the ring */
+        struct tcp_sbuf_extent *tail;
+    } sbuf; /* send buffer (ring, the retransmit queue refers to its data) */
+    struct {
+        uint32_t next; /* number of the next zero-copy send */
+        uint32_t done; /* zero-copy sends whose data is acknowledged */
+        uint32_t reported;
+    } zc;
+    uint16_t flags;
+    struct {
+        struct timeval expire; /* cleared while not running */
+        unsigned int timeout; /* micro seconds */
+    } persist;
+    struct {
+        struct timeval expire; /* cleared while no ACK is pending */
+        uint32_t pending; /* bytes received since the last ACK */
+    } delack;
+    struct tcp_cc cc; /* congestion control */
+    struct {
+        uint32_t srtt; /* micro seconds (0: not measured yet) */
+        uint32_t rttvar; /* micro seconds */
+        unsigned int rto; /* micro seconds, without the backoff */
+        unsigned int rto_min; /* micro seconds */
+        unsigned int backoff; /* number of the consecutive timeouts */
+        struct timeval expire; /* cleared while not running */
+        uint32_t recover; /* snd.nxt at the start of the recovery */
+        uint32_t lost; /* end of the data deemed lost */
+        uint32_t high; /* end of the data retransmitted so far */
+        unsigned int dupacks;
+    } rtx; /* retransmission (RFC 6298, RFC 6675) */
+    struct {
+        uint32_t offset; /* added to the clock, random per connection (rfc7323 - section 7.1) */
+        uint32_t recent; /* TS.Recent */
+        uint32_t recent_age; /* clock when TS.Recent was updated */
+        uint32_t last_ack_sent; /* Last.ACK.sent */
+        int eifel; /* the first ACK after the retransmission is pending (RFC 3522) */
+        uint32_t retransmitted; /* TSval of the first retransmission */
+    } ts; /* timestamps (RFC 7323) */
+    struct tcp_range *sack; /* scoreboard, SACKed data beyond snd.una (sorted by seq) */
+    int sack_num;
+    uint32_t sacked; /* bytes */
     struct sched_ctx ctx;
     struct queue_head queue; /* retransmit queue */
     struct timeval tw_timer;
     struct tcp_pcb *parent;
-    struct queue_head backlog;
+    struct queue_head backlog; /* accept queue */
+    unsigned int backlog_max;
+    unsigned int synq_num; /* half-open connections in the SYN queue (guarded by the table mutex) */
+    uint32_t syncookie_sent; /* clock of the last SYN cookie sent (0: never), the SYN queue overflowed */
+    struct tcp_pcb *hash_next[TCP_HASH_NUM]; /* chains of the hash tables */
+    uint8_t hashed; /* bitmap of the hash tables linking the PCB */
+    struct tcp_pcb *next; /* freelist */
+};
+
+/* NOTE: a range of the sequence space [seq, end) */
+struct tcp_range {
+    struct tcp_range *next;
+    uint32_t seq;
+    uint32_t end;
+};
+
+/* NOTE: a connection in the accept queue, the generation tells if it was released (and reused) meanwhile */
+struct tcp_backlog_entry {
+    struct tcp_pcb *pcb;
+    unsigned int gen;
+};
+
+/* NOTE: a half-open connection of a listener, the PCB is allocated by the ACK of the SYN-ACK */
+struct tcp_syn_entry {
+    struct tcp_syn_entry *next; /* hash chain or freelist */
+    struct tcp_pcb *listener; /* NULL: free */
+    struct ip_endpoint local;
+    struct ip_endpoint foreign;
+    struct tcp_segment_info syn; /* NOTE: seq is the IRS */
+    uint16_t wnd; /* window of the SYN-ACK */
+    uint8_t wscale; /* shift count sent in the SYN-ACK */
+    uint32_t iss;
+    uint32_t ts_offset;
+    struct timeval sent; /* the first SYN-ACK */
+    struct tcp_timer_link timer; /* retransmission of the SYN-ACK */
+    unsigned int retries;
+};
+
+/* NOTE: a segment waiting for the transmission, the segment follows the headroom for the IP header (IP_OUTPUT_HEADROOM) after the structure */
+struct tcp_output_entry {
+    struct ip_endpoint local;
+    struct ip_endpoint foreign;
+    size_t len;
+    uint16_t gso_size;
 };
 
 struct tcp_queue_entry {
     struct timeval first;
     struct timeval last;
-    unsigned int rto; /* micro seconds */
+    int retransmitted; /* NOTE: an ambiguous RTT sample (Karn's algorithm) */
     uint32_t seq;
     uint8_t flg;
-    size_t len;
+    size_t len; /* NOTE: the data is in the send buffer */
 };
 
+/*
+ * NOTE: The global mutex guards the tables (the PCB pool, the hash tables and the
+ *       SYN queue), and the mutex of each PCB guards the connection. The lock order
+ *       is the PCB of a listener, the PCB of a connection, then the global mutex,
+ *       which is never held while waiting for a PCB. The PCBs are never freed, so
+ *       a PCB looked up under the global mutex can be locked after unlocking it
+ *       and is still the same connection as long as its generation is unchanged.
+ */
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+static struct tcp_pcb *chunks[TCP_PCB_SIZE_MAX / TCP_PCB_CHUNK_SIZE]; /* pool of PCBs */
+static unsigned int chunk_num;
+static struct tcp_pcb *freelist;
+static struct tcp_hash {
+    struct tcp_pcb **buckets;
+    unsigned int size; /* power of 2 */
+    unsigned int num;
+} hashes[TCP_HASH_NUM];
+static int port_offset; /* next ephemeral port to try */
+static struct tcp_syn_entry synq[TCP_SYNQ_SIZE];
+static struct tcp_syn_entry *synq_buckets[TCP_SYNQ_SIZE];
+static struct tcp_syn_entry *synq_freelist;
+static unsigned int synq_num;
+static struct tcp_timer_wheel synq_timers; /* guarded by the global mutex as well */
+static mutex_t timer_mutex = MUTEX_INITIALIZER; /* NOTE: guards pcb_timers, the innermost lock */
+static struct tcp_timer_wheel pcb_timers;
+static struct {
+    int valid;
+    uint32_t count; /* the period of the key */
+    uint8_t key[16];
+} syncookie_keys[2]; /* NOTE: a new secret for each period, indexed by the period counter */
+static __thread struct queue_head output; /* segments built by this thread, not transmitted yet */
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, const uint8_t *opt, size_t optlen, const struct iovec *iov, int iovcnt, uint16_t gso_size, struct ip_endpoint *local, struct ip_endpoint *foreign);
+static void
+tcp_pcb_buffer_free(struct tcp_pcb *pcb);
+static void
+tcp_range_clear(struct tcp_range **list, int *num);
+static void
+tcp_delack_clear(struct tcp_pcb *pcb);
+static void
+tcp_sbuf_extent_clear(struct tcp_pcb *pcb);
+static struct tcp_pcb *
+tcp_backlog_child(struct tcp_pcb *listener, struct tcp_backlog_entry *backlog);
+static void
+tcp_synq_purge(struct tcp_pcb *listener);
+static void
+tcp_output_flush(void);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -158,30 +433,345 @@ tcp_dump(const uint8_t *data, size_t len)
 }
 
 /*
- * TCP Protocol Control Block (PCB)
+ * TCP PCB Hash Tables
  *
- * NOTE: TCP PCB functions must be called after mutex locked
+ * NOTE: The connections are indexed by 4-tuple, the listeners by local address/port
+ *       and every PCB holding a local port by the port (for bind/ephemeral port checks).
+ *       Each table doubles its buckets when the number of entries exceeds them.
+ * NOTE: TCP PCB Hash functions must be called after mutex locked
  */
 
+static uint32_t
+tcp_hash_key(int type, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct {
+        ip_addr_t laddr;
+        ip_addr_t faddr;
+        uint16_t lport;
+        uint16_t fport;
+    } key;
+
+    memset(&key, 0, sizeof(key));
+    switch (type) {
+    case TCP_HASH_CONN:
+        key.faddr = foreign->addr;
+        key.fport = foreign->port;
+        /* fall through */
+    case TCP_HASH_LISTEN:
+        key.laddr = local->addr;
+        /* fall through */
+    case TCP_HASH_BIND:
+        key.lport = local->port;
+        break;
+    }
+    return hash32(&key, sizeof(key), type);
+}
+
+static unsigned int
+tcp_hash_index(int type, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    return tcp_hash_key(type, local, foreign) & (hashes[type].size - 1);
+}
+
+static int
+tcp_hash_grow(int type)
+{
+    struct tcp_hash *h;
+    struct tcp_pcb **old, *pcb;
+    unsigned int size, i, index;
+
+    h = &hashes[type];
+    old = h->buckets;
+    size = h->size;
+    h->size = size ? size * 2 : TCP_HASH_SIZE_MIN;
+    h->buckets = memory_alloc(sizeof(*h->buckets) * h->size);
+    if (!h->buckets) {
+        errorf("memory_alloc() failure");
+        h->buckets = old;
+        h->size = size;
+        return -1;
+    }
+    for (i = 0; i < size; i++) {
+        while ((pcb = old[i]) != NULL) {
+            old[i] = pcb->hash_next[type];
+            index = tcp_hash_index(type, &pcb->local, &pcb->foreign);
+            pcb->hash_next[type] = h->buckets[index];
+            h->buckets[index] = pcb;
+        }
+    }
+    memory_free(old);
+    return 0;
+}
+
+static void
+tcp_hash_insert(int type, struct tcp_pcb *pcb)
+{
+    struct tcp_hash *h;
+    unsigned int index;
+
+    if (pcb->hashed & (1 << type)) {
+        return;
+    }
+    h = &hashes[type];
+    if (h->num >= h->size) {
+        /* NOTE: keep chaining in the current buckets if it fails */
+        tcp_hash_grow(type);
+    }
+    index = tcp_hash_index(type, &pcb->local, &pcb->foreign);
+    pcb->hash_next[type] = h->buckets[index];
+    h->buckets[index] = pcb;
+    pcb->hashed |= (1 << type);
+    h->num++;
+}
+
+static void
+tcp_hash_remove(int type, struct tcp_pcb *pcb)
+{
+    struct tcp_hash *h;
+    struct tcp_pcb **p;
+
+    if (!(pcb->hashed & (1 << type))) {
+        return;
+    }
+    h = &hashes[type];
+    for (p = &h->buckets[tcp_hash_index(type, &pcb->local, &pcb->foreign)]; *p; p = &(*p)->hash_next[type]) {
+        if (*p == pcb) {
+            *p = pcb->hash_next[type];
+            pcb->hash_next[type] = NULL;
+            pcb->hashed &= ~(1 << type);
+            h->num--;
+            return;
+        }
+    }
+}
+
 static struct tcp_pcb *
-tcp_pcb_alloc(void)
+tcp_hash_lookup_conn(struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            sched_ctx_init(&pcb->ctx);
+    pcb = hashes[TCP_HASH_CONN].buckets[tcp_hash_index(TCP_HASH_CONN, local, foreign)];
+    for (; pcb; pcb = pcb->hash_next[TCP_HASH_CONN]) {
+        if (pcb->local.addr == local->addr && pcb->local.port == local->port &&
+            pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+            return pcb;
+        }
+    }
+    return NULL;
+}
+
+static struct tcp_pcb *
+tcp_hash_lookup_listen(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct ip_endpoint key;
+    struct tcp_pcb *pcb, *wildcard;
+    int i;
+
+    key = *local;
+    /* NOTE: try the specific local address first, then the wildcard one */
+    for (i = 0; i < 2; i++) {
+        wildcard = NULL;
+        pcb = hashes[TCP_HASH_LISTEN].buckets[tcp_hash_index(TCP_HASH_LISTEN, &key, NULL)];
+        for (; pcb; pcb = pcb->hash_next[TCP_HASH_LISTEN]) {
+            if (pcb->local.addr != key.addr || pcb->local.port != key.port) {
+                continue;
+            }
+            if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+                return pcb;
+            }
+            if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) {
+                /* LISTENed with wildcard foreign address/port */
+                wildcard = pcb;
+            }
+        }
+        if (wildcard) {
+            return wildcard;
+        }
+        if (key.addr == IP_ADDR_ANY) {
+            break;
+        }
+        key.addr = IP_ADDR_ANY;
+    }
+    return NULL;
+}
+
+static struct tcp_pcb *
+tcp_hash_lookup_bind(struct ip_endpoint *local)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = hashes[TCP_HASH_BIND].buckets[tcp_hash_index(TCP_HASH_BIND, local, NULL)];
+    for (; pcb; pcb = pcb->hash_next[TCP_HASH_BIND]) {
+        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
             return pcb;
         }
     }
     return NULL;
 }
 
+/* NOTE: the PCB holding the port without the foreign endpoint (bound or listening), the port is not reusable for a connection */
+static struct tcp_pcb *
+tcp_hash_lookup_bind_unconnected(struct ip_endpoint *local)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = hashes[TCP_HASH_BIND].buckets[tcp_hash_index(TCP_HASH_BIND, local, NULL)];
+    for (; pcb; pcb = pcb->hash_next[TCP_HASH_BIND]) {
+        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
+            if (pcb->foreign.addr == IP_ADDR_ANY && !pcb->foreign.port) {
+                return pcb;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * TCP Timer Wheel
+ *
+ * NOTE: The armed timers are hashed into the slots by the tick (TCP_TIMER_INTERVAL)
+ *       they are due, each run visits only the slots of the ticks elapsed since the
+ *       last run. A timer due beyond one turn of the wheel stays until it is due.
+ * NOTE: TCP Timer Wheel functions must be called after the mutex of the wheel locked
+ */
+
+static uint64_t
+tcp_timer_tick(const struct timeval *tv)
+{
+    return ((uint64_t)tv->tv_sec * 1000000 + tv->tv_usec) / TCP_TIMER_INTERVAL;
+}
+
+static void
+tcp_timer_wheel_remove(struct tcp_timer_wheel *wheel, struct tcp_timer_link *link)
+{
+    if (!link->armed) {
+        return;
+    }
+    if (link->prev) {
+        link->prev->next = link->next;
+    } else {
+        wheel->slots[link->slot] = link->next;
+    }
+    if (link->next) {
+        link->next->prev = link->prev;
+    }
+    link->next = NULL;
+    link->prev = NULL;
+    link->armed = 0;
+}
+
+static void
+tcp_timer_wheel_insert(struct tcp_timer_wheel *wheel, struct tcp_timer_link *link, const struct timeval *due)
+{
+    uint64_t tick;
+
+    tcp_timer_wheel_remove(wheel, link);
+    /* NOTE: the one already due is visited by the next run */
+    tick = MAX(tcp_timer_tick(due), wheel->tick);
+    link->slot = tick & (TCP_TIMER_WHEEL_SIZE - 1);
+    link->due = *due;
+    link->prev = NULL;
+    link->next = wheel->slots[link->slot];
+    if (link->next) {
+        link->next->prev = link;
+    }
+    wheel->slots[link->slot] = link;
+    link->armed = 1;
+}
+
+/*
+ * NOTE: The due links are removed and passed to func, which may insert them again.
+ *       The slot of the current tick is visited again by the next run, it may hold
+ *       the links due later in the same tick.
+ */
+static void
+tcp_timer_wheel_expire(struct tcp_timer_wheel *wheel, const struct timeval *now, void (*func)(struct tcp_timer_link *link, void *arg), void *arg)
+{
+    struct tcp_timer_link *link, *next;
+    uint64_t last, tick;
+
+    last = tcp_timer_tick(now);
+    if (last - wheel->tick >= TCP_TIMER_WHEEL_SIZE) {
+        /* NOTE: the first run, or a stall (or the clock stepped), visit every slot once */
+        wheel->tick = last - (TCP_TIMER_WHEEL_SIZE - 1);
+    }
+    for (tick = wheel->tick; tick <= last; tick++) {
+        for (link = wheel->slots[tick & (TCP_TIMER_WHEEL_SIZE - 1)]; link; link = next) {
+            next = link->next;
+            if (timercmp(now, &link->due, >)) {
+                tcp_timer_wheel_remove(wheel, link);
+                func(link, arg);
+            }
+        }
+    }
+    wheel->tick = last;
+}
+
+/*
+ * TCP Protocol Control Block (PCB)
+ *
+ * NOTE: tcp_pcb_alloc() and tcp_pcb_get() return the PCB locked, the others must
+ *       be called after the PCB locked (tcp_pcb_select() after mutex locked)
+ * NOTE: tcp_pcb_unlock() must be used by the outermost lock holder to transmit the segments
+ * NOTE: the PCB released remains locked, the caller unlocks it as usual
+ */
+
+static struct tcp_pcb *
+tcp_pcb_entry(unsigned int index)
+{
+    return &chunks[index / TCP_PCB_CHUNK_SIZE][index % TCP_PCB_CHUNK_SIZE];
+}
+
+static struct tcp_pcb *
+tcp_pcb_alloc(void)
+{
+    struct tcp_pcb *pcb;
+    int i;
+
+    mutex_lock(&mutex);
+    if (!freelist && chunk_num < countof(chunks)) {
+        chunks[chunk_num] = memory_alloc(sizeof(struct tcp_pcb) * TCP_PCB_CHUNK_SIZE);
+        if (chunks[chunk_num]) {
+            for (i = TCP_PCB_CHUNK_SIZE - 1; i >= 0; i--) {
+                mutex_init(&chunks[chunk_num][i].mutex);
+                chunks[chunk_num][i].id = chunk_num * TCP_PCB_CHUNK_SIZE + i;
+                chunks[chunk_num][i].next = freelist;
+                freelist = &chunks[chunk_num][i];
+            }
+            /* NOTE: tcp_pcb_get() reads it without the mutex */
+            __atomic_store_n(&chunk_num, chunk_num + 1, __ATOMIC_RELEASE);
+        }
+    }
+    if (!freelist) {
+        mutex_unlock(&mutex);
+        return NULL;
+    }
+    pcb = freelist;
+    freelist = pcb->next;
+    mutex_unlock(&mutex);
+    /* NOTE: a stale reference may hold it until it sees the generation changed */
+    mutex_lock(&pcb->mutex);
+    if (pcb->kept) {
+        /* NOTE: the views borrowed from the previous connection are no longer valid */
+        memory_free(pcb->kept);
+        pcb->kept = NULL;
+    }
+    pcb->next = NULL;
+    pcb->state = TCP_PCB_STATE_CLOSED;
+    pcb->rbuf.size = TCP_RCVBUF_SIZE_DEFAULT;
+    pcb->sbuf.size = TCP_SNDBUF_SIZE_DEFAULT;
+    pcb->cc.ops = tcp_cc_lookup(TCP_CC_DEFAULT);
+    pcb->rtx.rto = TCP_RTO_INITIAL;
+    pcb->rtx.rto_min = TCP_RTO_MIN_DEFAULT;
+    sched_ctx_init(&pcb->ctx);
+    return pcb;
+}
+
 static void
 tcp_pcb_release(struct tcp_pcb *pcb)
 {
     struct queue_entry *entry;
+    struct tcp_backlog_entry *backlog;
     struct tcp_pcb *est;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
@@ -193,36 +783,86 @@ tcp_pcb_release(struct tcp_pcb *pcb)
     while ((entry = queue_pop(&pcb->queue)) != NULL) {
         memory_free(entry);
     }
-    while ((est = queue_pop(&pcb->backlog)) != NULL) {
-        tcp_pcb_release(est);
+    while ((backlog = queue_pop(&pcb->backlog)) != NULL) {
+        est = tcp_backlog_child(pcb, backlog);
+        if (est) {
+            tcp_pcb_release(est);
+            mutex_unlock(&est->mutex);
+        }
     }
+    tcp_pcb_buffer_free(pcb);
+    mutex_lock(&timer_mutex);
+    tcp_timer_wheel_remove(&pcb_timers, &pcb->timer);
+    mutex_unlock(&timer_mutex);
     debugf("released, local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    memset(pcb, 0, sizeof(*pcb));
+    mutex_lock(&mutex);
+    if (pcb->synq_num) {
+        tcp_synq_purge(pcb);
+    }
+    tcp_hash_remove(TCP_HASH_CONN, pcb);
+    tcp_hash_remove(TCP_HASH_LISTEN, pcb);
+    tcp_hash_remove(TCP_HASH_BIND, pcb);
+    pcb->gen++;
+    memset(&pcb->state, 0, sizeof(*pcb) - offsetof(struct tcp_pcb, state));
+    pcb->next = freelist;
+    freelist = pcb;
+    mutex_unlock(&mutex);
 }
 
 static struct tcp_pcb *
 tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    struct tcp_pcb *pcb, *listen_pcb = NULL;
+    struct tcp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
-            if (!foreign) {
-                return pcb;
-            }
-            if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
-                return pcb;
-            }
-            if (pcb->state == TCP_PCB_STATE_LISTEN) {
-                if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) {
-                    /* LISTENed with wildcard foreign address/port */
-                    listen_pcb = pcb;
-                }
-            }
+    if (!foreign) {
+        return tcp_hash_lookup_bind(local);
+    }
+    pcb = tcp_hash_lookup_conn(local, foreign);
+    if (pcb) {
+        return pcb;
+    }
+    return tcp_hash_lookup_listen(local, foreign);
+}
+
+/* NOTE: the PCB of the segment, locked (it must be unlocked after use) */
+static struct tcp_pcb *
+tcp_pcb_lookup(struct ip_endpoint *local, struct ip_endpoint *foreign, int established)
+{
+    struct tcp_pcb *pcb;
+    unsigned int gen;
+
+    while (1) {
+        mutex_lock(&mutex);
+        pcb = established ? tcp_hash_lookup_conn(local, foreign) : tcp_pcb_select(local, foreign);
+        if (!pcb) {
+            mutex_unlock(&mutex);
+            return NULL;
+        }
+        gen = pcb->gen;
+        mutex_unlock(&mutex);
+        mutex_lock(&pcb->mutex);
+        if (pcb->gen == gen) {
+            return pcb;
         }
+        /* released meanwhile, look up again */
+        mutex_unlock(&pcb->mutex);
+    }
+}
+
+/* NOTE: the PCB found by the early lookup, locked (NULL: released meanwhile) */
+static struct tcp_pcb *
+tcp_pcb_get_early(const struct ip_early_flow *flow)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_entry(flow->id);
+    mutex_lock(&pcb->mutex);
+    if (pcb->gen != flow->gen) {
+        mutex_unlock(&pcb->mutex);
+        return NULL;
     }
-    return listen_pcb;
+    return pcb;
 }
 
 static struct tcp_pcb *
@@ -230,44 +870,1024 @@ tcp_pcb_get(int id)
 {
     struct tcp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
+    if (id < 0 || id >= (int)(__atomic_load_n(&chunk_num, __ATOMIC_ACQUIRE) * TCP_PCB_CHUNK_SIZE)) {
         /* out of range */
         return NULL;
     }
-    pcb = &pcbs[id];
+    pcb = tcp_pcb_entry(id);
+    mutex_lock(&pcb->mutex);
     if (pcb->state == TCP_PCB_STATE_FREE) {
+        mutex_unlock(&pcb->mutex);
         return NULL;
     }
     return pcb;
 }
 
-static int
-tcp_pcb_id(struct tcp_pcb *pcb)
+/* NOTE: the segments queued while the PCB is locked are transmitted after unlocking it */
+static void
+tcp_pcb_unlock(struct tcp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    mutex_unlock(&pcb->mutex);
+    tcp_output_flush();
 }
 
 /*
- * TCP Retransmit
- *
- * NOTE: TCP Retransmit functions must be called after mutex locked
+ * NOTE: the queued segments are transmitted before sleeping, the wakeup may depend on them
+ * NOTE: if any segment is queued, it returns without sleeping after transmitting them unlocked (callers must recheck the condition)
  */
-
 static int
-tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+tcp_pcb_sleep(struct tcp_pcb *pcb, const struct timespec *abstime)
 {
-    struct tcp_queue_entry *entry;
+    if (output.num) {
+        mutex_unlock(&pcb->mutex);
+        tcp_output_flush();
+        mutex_lock(&pcb->mutex);
+        return 0;
+    }
+    return sched_sleep(&pcb->ctx, &pcb->mutex, abstime);
+}
 
-    entry = memory_alloc(sizeof(*entry) + len);
-    if (!entry) {
-        errorf("memory_alloc() failure");
-        return -1;
+static void
+tcp_pcb_timer_earlier(struct timeval *due, const struct timeval *expire)
+{
+    if (timerisset(expire) && (!timerisset(due) || timercmp(expire, due, <))) {
+        *due = *expire;
     }
-    entry->rto = TCP_DEFAULT_RTO;
-    entry->seq = seq;
-    entry->flg = flg;
+}
+
+/* NOTE: arm the timer wheel with the earliest timer, called after any timer set (a timer cleared is dropped when it is visited) */
+static void
+tcp_pcb_timer_update(struct tcp_pcb *pcb)
+{
+    struct timeval due;
+
+    timerclear(&due);
+    tcp_pcb_timer_earlier(&due, &pcb->rtx.expire);
+    tcp_pcb_timer_earlier(&due, &pcb->delack.expire);
+    tcp_pcb_timer_earlier(&due, &pcb->persist.expire);
+    if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
+        tcp_pcb_timer_earlier(&due, &pcb->tw_timer);
+    }
+    mutex_lock(&timer_mutex);
+    if (timerisset(&due)) {
+        tcp_timer_wheel_insert(&pcb_timers, &pcb->timer, &due);
+    } else {
+        tcp_timer_wheel_remove(&pcb_timers, &pcb->timer);
+    }
+    mutex_unlock(&timer_mutex);
+}
+
+static int
+tcp_pcb_id(struct tcp_pcb *pcb)
+{
+    return pcb->id;
+}
+
+/* NOTE: the data buffers are allocated only while the connection is established */
+static int
+tcp_pcb_buffer_alloc(struct tcp_pcb *pcb)
+{
+    pcb->rbuf.data = memory_alloc(pcb->rbuf.size);
+    if (!pcb->rbuf.data) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    pcb->sbuf.data = memory_alloc(pcb->sbuf.size);
+    if (!pcb->sbuf.data) {
+        errorf("memory_alloc() failure");
+        memory_free(pcb->rbuf.data);
+        pcb->rbuf.data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void
+tcp_pcb_buffer_free(struct tcp_pcb *pcb)
+{
+    tcp_range_clear(&pcb->ooo, &pcb->ooo_num);
+    tcp_range_clear(&pcb->sack, &pcb->sack_num);
+    pcb->sacked = 0;
+    if (pcb->rbuf.lent && pcb->rbuf.data) {
+        /* NOTE: the user may still be reading it, freed on the release or the reuse */
+        pcb->kept = pcb->rbuf.data;
+    } else {
+        memory_free(pcb->rbuf.data);
+    }
+    pcb->rbuf.data = NULL;
+    memory_free(pcb->sbuf.data);
+    pcb->sbuf.data = NULL;
+    tcp_sbuf_extent_clear(pcb);
+}
+
+/* NOTE: the largest segment we can receive (sent in the MSS option) */
+static uint16_t
+tcp_local_mss(struct ip_endpoint *local)
+{
+    struct ip_iface *iface;
+
+    iface = ip_route_get_iface(local->addr);
+    if (!iface) {
+        return TCP_DEFAULT_MSS;
+    }
+    return NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+}
+
+static void
+tcp_pcb_set_mss(struct tcp_pcb *pcb)
+{
+    /* NOTE: the peer which did not send the MSS option accepts only the default (rfc9293 - section 3.7.1) */
+    pcb->mss = MIN(tcp_local_mss(&pcb->local), pcb->peer_mss ? pcb->peer_mss : TCP_DEFAULT_MSS);
+    if ((pcb->flags & TCP_PCB_FLG_TS) && pcb->mss > TCP_OPTION_TIMESTAMP_SPACE) {
+        /* NOTE: every segment carries the option */
+        pcb->mss -= TCP_OPTION_TIMESTAMP_SPACE;
+    }
+}
+
+/* NOTE: milli seconds, monotonic */
+static uint32_t
+tcp_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint32_t
+tcp_pcb_tsval(struct tcp_pcb *pcb)
+{
+    return tcp_clock() + pcb->ts.offset;
+}
+
+/* NOTE: the smallest shift count to advertise the whole receive buffer */
+static uint8_t
+tcp_pcb_wscale(struct tcp_pcb *pcb)
+{
+    uint8_t shift = 0;
+
+    while (shift < TCP_WSCALE_MAX && (pcb->rbuf.size >> shift) > 0xffff) {
+        shift++;
+    }
+    return shift;
+}
+
+/* NOTE: the window field of a SYN is never scaled (rfc7323 - section 2.2) */
+static uint16_t
+tcp_pcb_window(struct tcp_pcb *pcb, uint8_t flg)
+{
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        return MIN(pcb->rcv.wnd, 0xffff);
+    }
+    return MIN(pcb->rcv.wnd >> pcb->rcv.wscale, 0xffff);
+}
+
+/*
+ * TCP Receive Buffer
+ *
+ * NOTE: TCP Receive Buffer functions must be called after mutex locked
+ */
+
+/* NOTE: off is the offset from the write index (i.e. from rcv.nxt), it does not move the index */
+static void
+tcp_rbuf_write(struct tcp_pcb *pcb, size_t off, const uint8_t *data, size_t len)
+{
+    size_t pos, n;
+
+    pos = (pcb->rbuf.tail + off) % pcb->rbuf.size;
+    n = MIN(len, pcb->rbuf.size - pos);
+    memcpy(pcb->rbuf.data + pos, data, n);
+    memcpy(pcb->rbuf.data, data + n, len - n);
+}
+
+/* NOTE: the first len bytes of the buffered data are described by at most two segments */
+static int
+tcp_rbuf_peek(struct tcp_pcb *pcb, struct iovec *iov, size_t off, size_t len)
+{
+    size_t pos, n;
+
+    if (!len) {
+        return 0;
+    }
+    pos = (pcb->rbuf.head + off) % pcb->rbuf.size;
+    n = MIN(len, pcb->rbuf.size - pos);
+    iov[0].iov_base = pcb->rbuf.data + pos;
+    iov[0].iov_len = n;
+    if (n == len) {
+        return 1;
+    }
+    iov[1].iov_base = pcb->rbuf.data;
+    iov[1].iov_len = len - n;
+    return 2;
+}
+
+static void
+tcp_rbuf_consume(struct tcp_pcb *pcb, size_t len)
+{
+    pcb->rbuf.head = (pcb->rbuf.head + len) % pcb->rbuf.size;
+    pcb->rcv.wnd += len;
+}
+
+/* NOTE: the data to read (not borrowed yet) */
+static size_t
+tcp_rbuf_readable(struct tcp_pcb *pcb)
+{
+    return pcb->rbuf.size - pcb->rcv.wnd - pcb->rbuf.lent;
+}
+
+/* NOTE: the data the reader of size bytes waits for, at most what the buffer can hold */
+static size_t
+tcp_rbuf_lowat(struct tcp_pcb *pcb, size_t size)
+{
+    size_t lowat;
+
+    lowat = MIN(MAX(pcb->rbuf.lowat, 1), size);
+    return MIN(lowat, (size_t)(pcb->rbuf.size - pcb->rbuf.lent));
+}
+
+/*
+ * TCP Reassembly
+ *
+ * NOTE: The data in the window is written into the receive buffer wherever it
+ *       belongs, the out-of-order ranges are kept as a sorted list of intervals
+ *       and released to the reader once the hole before them is filled.
+ * NOTE: TCP Reassembly functions must be called after mutex locked
+ */
+
+static void
+tcp_range_clear(struct tcp_range **list, int *num)
+{
+    struct tcp_range *range;
+
+    while ((range = *list) != NULL) {
+        *list = range->next;
+        memory_free(range);
+    }
+    *num = 0;
+}
+
+static int
+tcp_range_insert(struct tcp_range **list, int *num, uint32_t seq, uint32_t end)
+{
+    struct tcp_range **p, *range, *next;
+
+    for (p = list; *p && TCP_SEQ_LT((*p)->end, seq); p = &(*p)->next);
+    if (!*p || TCP_SEQ_LT(end, (*p)->seq)) {
+        /* no overlap/adjacency, a new range */
+        if (*num >= TCP_RANGE_MAX) {
+            return -1;
+        }
+        range = memory_alloc(sizeof(*range));
+        if (!range) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        range->seq = seq;
+        range->end = end;
+        range->next = *p;
+        *p = range;
+        (*num)++;
+        return 0;
+    }
+    /* merge into the range and absorb the following ones it reaches */
+    range = *p;
+    if (TCP_SEQ_LT(seq, range->seq)) {
+        range->seq = seq;
+    }
+    if (TCP_SEQ_LT(range->end, end)) {
+        range->end = end;
+    }
+    while ((next = range->next) != NULL && TCP_SEQ_LEQ(next->seq, range->end)) {
+        if (TCP_SEQ_LT(range->end, next->end)) {
+            range->end = next->end;
+        }
+        range->next = next->next;
+        memory_free(next);
+        (*num)--;
+    }
+    return 0;
+}
+
+/* NOTE: returns the number of bytes which became in-order (readable) */
+static size_t
+tcp_reassemble(struct tcp_pcb *pcb, uint32_t seq, const uint8_t *data, size_t len)
+{
+    struct tcp_range *range;
+    size_t off, n;
+
+    if (TCP_SEQ_LT(seq, pcb->rcv.nxt)) {
+        /* trim the part already received */
+        off = pcb->rcv.nxt - seq;
+        if (off >= len) {
+            return 0;
+        }
+        data += off;
+        len -= off;
+        seq = pcb->rcv.nxt;
+    }
+    off = seq - pcb->rcv.nxt;
+    if (off >= pcb->rcv.wnd) {
+        return 0;
+    }
+    len = MIN(len, pcb->rcv.wnd - off); /* trim the part beyond the window */
+    if (off) {
+        if (tcp_range_insert(&pcb->ooo, &pcb->ooo_num, seq, seq + len) == -1) {
+            /* drop, it will be retransmitted */
+            return 0;
+        }
+        tcp_rbuf_write(pcb, off, data, len);
+        pcb->ooo_recent = seq;
+        return 0;
+    }
+    tcp_rbuf_write(pcb, 0, data, len);
+    n = len;
+    while ((range = pcb->ooo) != NULL && TCP_SEQ_LEQ(range->seq, pcb->rcv.nxt + n)) {
+        /* the hole is filled */
+        if (TCP_SEQ_LT(pcb->rcv.nxt + n, range->end)) {
+            n = range->end - pcb->rcv.nxt;
+        }
+        pcb->ooo = range->next;
+        memory_free(range);
+        pcb->ooo_num--;
+    }
+    pcb->rbuf.tail = (pcb->rbuf.tail + n) % pcb->rbuf.size;
+    pcb->rcv.nxt += n;
+    pcb->rcv.wnd -= n;
+    return n;
+}
+
+/*
+ * TCP Options
+ *
+ * NOTE: TCP Options functions must be called after mutex locked
+ */
+
+static void
+tcp_options_parse(const uint8_t *opt, size_t len, struct tcp_segment_info *seg)
+{
+    uint8_t kind, olen;
+    int i;
+
+    while (len) {
+        kind = opt[0];
+        if (kind == TCP_OPTION_EOL) {
+            break;
+        }
+        if (kind == TCP_OPTION_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+        if (len < 2 || opt[1] < 2 || opt[1] > len) {
+            /* malformed, ignore the rest */
+            break;
+        }
+        olen = opt[1];
+        switch (kind) {
+        case TCP_OPTION_MSS:
+            if (olen == 4) {
+                seg->mss = (uint16_t)opt[2] << 8 | opt[3];
+            }
+            break;
+        case TCP_OPTION_WSCALE:
+            if (olen == 3) {
+                seg->wscale_ok = 1;
+                seg->wscale = opt[2];
+            }
+            break;
+        case TCP_OPTION_SACK_PERM:
+            if (olen == 2) {
+                seg->sack_perm = 1;
+            }
+            break;
+        case TCP_OPTION_TIMESTAMP:
+            if (olen == 10) {
+                seg->ts_ok = 1;
+                memcpy(&seg->tsval, opt + 2, 4);
+                memcpy(&seg->tsecr, opt + 6, 4);
+                seg->tsval = ntoh32(seg->tsval);
+                seg->tsecr = ntoh32(seg->tsecr);
+            }
+            break;
+        case TCP_OPTION_SACK:
+            for (i = 0; i < (olen - 2) / 8 && seg->sack_num < TCP_SACK_BLOCK_MAX; i++) {
+                memcpy(&seg->sack[seg->sack_num].seq, opt + 2 + i * 8, 4);
+                memcpy(&seg->sack[seg->sack_num].end, opt + 6 + i * 8, 4);
+                seg->sack[seg->sack_num].seq = ntoh32(seg->sack[seg->sack_num].seq);
+                seg->sack[seg->sack_num].end = ntoh32(seg->sack[seg->sack_num].end);
+                seg->sack_num++;
+            }
+            break;
+        default:
+            /* ignore: unknown option */
+            break;
+        }
+        opt += olen;
+        len -= olen;
+    }
+}
+
+static size_t
+tcp_options_sack_block(uint8_t *opt, struct tcp_range *range)
+{
+    uint32_t n;
+
+    n = hton32(range->seq);
+    memcpy(opt, &n, 4);
+    n = hton32(range->end);
+    memcpy(opt + 4, &n, 4);
+    return 8;
+}
+
+static size_t
+tcp_options_timestamp(uint8_t *opt, uint32_t tsval, uint32_t tsecr)
+{
+    uint32_t n;
+
+    opt[0] = TCP_OPTION_NOP;
+    opt[1] = TCP_OPTION_NOP;
+    opt[2] = TCP_OPTION_TIMESTAMP;
+    opt[3] = 10;
+    n = hton32(tsval);
+    memcpy(opt + 4, &n, 4);
+    n = hton32(tsecr);
+    memcpy(opt + 8, &n, 4);
+    return TCP_OPTION_TIMESTAMP_SPACE;
+}
+
+/* NOTE: the options of a SYN, the ones other than the MSS are selected by the PCB flags */
+static size_t
+tcp_options_syn(uint8_t *opt, uint16_t mss, uint16_t flags, uint8_t wscale, uint32_t tsval, uint32_t tsecr)
+{
+    size_t optlen = 0;
+
+    opt[optlen++] = TCP_OPTION_MSS;
+    opt[optlen++] = 4;
+    opt[optlen++] = mss >> 8;
+    opt[optlen++] = mss & 0xff;
+    if (flags & TCP_PCB_FLG_WSCALE) {
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_WSCALE;
+        opt[optlen++] = 3;
+        opt[optlen++] = wscale;
+    }
+    if (flags & TCP_PCB_FLG_SACK) {
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_NOP;
+        opt[optlen++] = TCP_OPTION_SACK_PERM;
+        opt[optlen++] = 2;
+    }
+    if (flags & TCP_PCB_FLG_TS) {
+        optlen += tcp_options_timestamp(opt + optlen, tsval, tsecr);
+    }
+    return optlen;
+}
+
+/*
+ * NOTE: The SYN carries the MSS and offers the window scale, SACK and the
+ *       timestamps (the SYN-ACK accepts them). Once the timestamps are in
+ *       use every segment carries them, and a pure ACK reports the
+ *       out-of-order data as SACK blocks, the block of the latest segment first.
+ * NOTE: the length is a multiple of 4 (padded with NOP)
+ * NOTE: the segment is assumed to be sent with rcv.nxt as its ACK (Last.ACK.sent)
+ */
+static size_t
+tcp_options_build(struct tcp_pcb *pcb, uint8_t flg, size_t len, uint8_t *opt)
+{
+    struct tcp_range *range, *recent = NULL;
+    size_t optlen = 0, sack;
+    uint16_t flags;
+    int num = 0;
+
+    if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        pcb->ts.last_ack_sent = pcb->rcv.nxt;
+    }
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        if (!TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+            flags = TCP_PCB_FLG_WSCALE | TCP_PCB_FLG_SACK | TCP_PCB_FLG_TS;
+            return tcp_options_syn(opt, tcp_local_mss(&pcb->local), flags, pcb->rcv.wscale, tcp_pcb_tsval(pcb), 0);
+        }
+        return tcp_options_syn(opt, tcp_local_mss(&pcb->local), pcb->flags, pcb->rcv.wscale, tcp_pcb_tsval(pcb), pcb->ts.recent);
+    }
+    if (pcb->flags & TCP_PCB_FLG_TS) {
+        optlen += tcp_options_timestamp(opt + optlen, tcp_pcb_tsval(pcb), pcb->ts.recent);
+    }
+    /* NOTE: not on the data segments, the option space would reduce the MSS */
+    if (!(pcb->flags & TCP_PCB_FLG_SACK) || !pcb->ooo || len) {
+        return optlen;
+    }
+    sack = optlen;
+    opt[optlen++] = TCP_OPTION_NOP;
+    opt[optlen++] = TCP_OPTION_NOP;
+    opt[optlen++] = TCP_OPTION_SACK;
+    opt[optlen++] = 2;
+    for (range = pcb->ooo; range; range = range->next) {
+        if (TCP_SEQ_LEQ(range->seq, pcb->ooo_recent) && TCP_SEQ_LT(pcb->ooo_recent, range->end)) {
+            recent = range;
+            optlen += tcp_options_sack_block(opt + optlen, range);
+            num++;
+            break;
+        }
+    }
+    for (range = pcb->ooo; range && num < TCP_SACK_BLOCK_MAX && optlen + 8 <= TCP_OPTION_SPACE_MAX; range = range->next) {
+        if (range != recent) {
+            optlen += tcp_options_sack_block(opt + optlen, range);
+            num++;
+        }
+    }
+    opt[sack + 3] = 2 + num * 8;
+    return optlen;
+}
+
+/* NOTE: called on the SYN of the peer, an option is in effect only if both ends sent it */
+static void
+tcp_options_negotiate(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    if (seg->mss && seg->mss < TCP_MIN_MSS) {
+        debugf("MSS is too small, mss=%u", seg->mss);
+        pcb->peer_mss = TCP_MIN_MSS;
+    } else {
+        pcb->peer_mss = seg->mss;
+    }
+    if (seg->wscale_ok) {
+        pcb->flags |= TCP_PCB_FLG_WSCALE;
+        if (seg->wscale > TCP_WSCALE_MAX) {
+            debugf("window scale is too large, wscale=%u", seg->wscale);
+        }
+        pcb->snd.wscale = MIN(seg->wscale, TCP_WSCALE_MAX);
+    } else {
+        /* NOTE: our window is limited to 65535 bytes */
+        pcb->snd.wscale = 0;
+        pcb->rcv.wscale = 0;
+    }
+    if (seg->sack_perm) {
+        pcb->flags |= TCP_PCB_FLG_SACK;
+    }
+    if (seg->ts_ok) {
+        pcb->flags |= TCP_PCB_FLG_TS;
+        pcb->ts.recent = seg->tsval;
+        pcb->ts.recent_age = tcp_clock();
+    }
+}
+
+/* rfc7323 - section 5.3 (PAWS), NOTE: true if the segment is an old duplicate */
+static int
+tcp_options_paws(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    if (!(pcb->flags & TCP_PCB_FLG_TS) || !seg->ts_ok) {
+        return 0;
+    }
+    if (!TCP_SEQ_LT(seg->tsval, pcb->ts.recent)) {
+        return 0;
+    }
+    if (tcp_clock() - pcb->ts.recent_age > TCP_PAWS_IDLE) {
+        /* NOTE: TS.Recent is too old to be compared */
+        return 0;
+    }
+    return 1;
+}
+
+/* rfc7323 - section 4.3 */
+static void
+tcp_options_ts_update(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    if (!(pcb->flags & TCP_PCB_FLG_TS) || !seg->ts_ok) {
+        return;
+    }
+    if (TCP_SEQ_LEQ(pcb->ts.recent, seg->tsval) && TCP_SEQ_LEQ(seg->seq, pcb->ts.last_ack_sent)) {
+        pcb->ts.recent = seg->tsval;
+        pcb->ts.recent_age = tcp_clock();
+    }
+}
+
+/*
+ * TCP SACK Scoreboard
+ *
+ * NOTE: The ranges reported by the peer are kept above snd.una, the data in
+ *       the holes between them (below the highest one) is deemed lost while
+ *       recovering (a simplification of RFC 6675 IsLost()).
+ * NOTE: TCP SACK Scoreboard functions must be called after mutex locked
+ */
+
+static void
+tcp_sack_count(struct tcp_pcb *pcb)
+{
+    struct tcp_range *range;
+
+    pcb->sacked = 0;
+    for (range = pcb->sack; range; range = range->next) {
+        pcb->sacked += range->end - range->seq;
+    }
+}
+
+static void
+tcp_sack_update(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    uint32_t seq, end;
+    int i;
+
+    for (i = 0; i < seg->sack_num; i++) {
+        seq = TCP_SEQ_MAX(seg->sack[i].seq, pcb->snd.una);
+        end = seg->sack[i].end;
+        if (TCP_SEQ_LT(pcb->snd.nxt, end)) {
+            end = pcb->snd.nxt;
+        }
+        if (!TCP_SEQ_LT(seq, end)) {
+            /* stale or bogus */
+            continue;
+        }
+        tcp_range_insert(&pcb->sack, &pcb->sack_num, seq, end);
+    }
+    tcp_sack_count(pcb);
+}
+
+/* NOTE: called when snd.una advanced */
+static void
+tcp_sack_trim(struct tcp_pcb *pcb)
+{
+    struct tcp_range *range;
+
+    while ((range = pcb->sack) != NULL && TCP_SEQ_LEQ(range->end, pcb->snd.una)) {
+        pcb->sack = range->next;
+        memory_free(range);
+        pcb->sack_num--;
+    }
+    if (range && TCP_SEQ_LT(range->seq, pcb->snd.una)) {
+        range->seq = pcb->snd.una;
+    }
+    tcp_sack_count(pcb);
+}
+
+/* NOTE: end of the highest SACKed range (snd.una if none) */
+static uint32_t
+tcp_sack_fack(struct tcp_pcb *pcb)
+{
+    struct tcp_range *range;
+
+    for (range = pcb->sack; range && range->next; range = range->next);
+    return range ? range->end : pcb->snd.una;
+}
+
+/* NOTE: bytes in [snd.una, end) which are not SACKed */
+static uint32_t
+tcp_sack_holes(struct tcp_pcb *pcb, uint32_t end)
+{
+    struct tcp_range *range;
+    uint32_t n;
+
+    if (!TCP_SEQ_LT(pcb->snd.una, end)) {
+        return 0;
+    }
+    n = end - pcb->snd.una;
+    for (range = pcb->sack; range && TCP_SEQ_LT(range->seq, end); range = range->next) {
+        n -= (TCP_SEQ_LT(range->end, end) ? range->end : end) - range->seq;
+    }
+    return n;
+}
+
+/* rfc6675 - section 4 (SetPipe) */
+static uint32_t
+tcp_pipe(struct tcp_pcb *pcb)
+{
+    uint32_t pipe;
+
+    pipe = tcp_sack_holes(pcb, pcb->snd.nxt);
+    if (pcb->flags & (TCP_PCB_FLG_RECOVERY | TCP_PCB_FLG_LOSS)) {
+        /* the lost data has left the network, unless it is retransmitted */
+        pipe -= tcp_sack_holes(pcb, pcb->rtx.lost);
+        pipe += tcp_sack_holes(pcb, pcb->rtx.high);
+    }
+    return pipe;
+}
+
+/*
+ * TCP Send Buffer
+ *
+ * NOTE: The data stays in the buffer until it is acknowledged, the offset
+ *       from snd.una locates the data of a (re)transmitted segment.
+ * NOTE: The zero-copy data is not copied into the ring, the buffer of the
+ *       user is referred by an extent until it is acknowledged. Once an extent
+ *       exists the extents describe the whole buffer in the order of the stream.
+ * NOTE: The payload of a segment is copied once, when it is built
+ *       (tcp_output_entry); the segment is transmitted after the PCB is
+ *       unlocked, and the buffer may be changed (acknowledged, or completed
+ *       and reused by the user) meanwhile. The IP header and the GSO frames
+ *       are built in place in the entry (see ip_output_headroom()), so no
+ *       more copy is made until the device.
+ * NOTE: TCP Send Buffer functions must be called after mutex locked
+ */
+
+/* NOTE: the zero-copy sends pending on the extents are completed as well (their buffers are no longer referred) */
+static void
+tcp_sbuf_extent_clear(struct tcp_pcb *pcb)
+{
+    struct tcp_sbuf_extent *extent;
+
+    while (pcb->sbuf.extents) {
+        extent = pcb->sbuf.extents;
+        pcb->sbuf.extents = extent->next;
+        if (extent->notify) {
+            pcb->zc.done = extent->notify;
+        }
+        memory_free(extent);
+    }
+    pcb->sbuf.tail = NULL;
+}
+
+static int
+tcp_sbuf_extent_append(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+    struct tcp_sbuf_extent *extent;
+
+    extent = pcb->sbuf.tail;
+    if (!data && extent && !extent->data && !extent->notify) {
+        /* NOTE: the ring data following the ring data */
+        extent->len += len;
+        return 0;
+    }
+    extent = memory_alloc(sizeof(*extent));
+    if (!extent) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    extent->data = data;
+    extent->len = len;
+    if (pcb->sbuf.tail) {
+        pcb->sbuf.tail->next = extent;
+    } else {
+        pcb->sbuf.extents = extent;
+    }
+    pcb->sbuf.tail = extent;
+    return 0;
+}
+
+static size_t
+tcp_sbuf_write(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+    size_t tail, n;
+
+    len = MIN(len, (size_t)(pcb->sbuf.size - pcb->sbuf.len));
+    if (!len) {
+        return 0;
+    }
+    if (pcb->sbuf.extents && tcp_sbuf_extent_append(pcb, NULL, len) == -1) {
+        return 0;
+    }
+    tail = (pcb->sbuf.head + pcb->sbuf.used) % pcb->sbuf.size;
+    n = MIN(len, pcb->sbuf.size - tail);
+    memcpy(pcb->sbuf.data + tail, data, n);
+    memcpy(pcb->sbuf.data, data + n, len - n);
+    pcb->sbuf.used += len;
+    pcb->sbuf.len += len;
+    return len;
+}
+
+/* NOTE: the data is referred (not copied), it counts against the size of the buffer as well */
+static ssize_t
+tcp_sbuf_reference(struct tcp_pcb *pcb, const uint8_t *data, size_t len)
+{
+    len = MIN(len, (size_t)(pcb->sbuf.size - pcb->sbuf.len));
+    if (!len) {
+        return 0;
+    }
+    if (!pcb->sbuf.extents && pcb->sbuf.len) {
+        /* NOTE: the data buffered so far */
+        if (tcp_sbuf_extent_append(pcb, NULL, pcb->sbuf.len) == -1) {
+            return -1;
+        }
+    }
+    if (tcp_sbuf_extent_append(pcb, data, len) == -1) {
+        return -1;
+    }
+    pcb->sbuf.len += len;
+    return len;
+}
+
+/* NOTE: a zero-copy send is completed when the data buffered so far is acknowledged */
+static void
+tcp_sbuf_notify(struct tcp_pcb *pcb)
+{
+    pcb->zc.next++;
+    if (!pcb->sbuf.tail) {
+        /* NOTE: acknowledged while waiting for the buffer space */
+        pcb->zc.done = pcb->zc.next;
+        return;
+    }
+    pcb->sbuf.tail->notify = pcb->zc.next;
+}
+
+static int
+tcp_sbuf_peek_ring(struct tcp_pcb *pcb, struct iovec *iov, size_t off, size_t len)
+{
+    size_t pos, n;
+
+    pos = (pcb->sbuf.head + off) % pcb->sbuf.size;
+    n = MIN(len, pcb->sbuf.size - pos);
+    iov[0].iov_base = pcb->sbuf.data + pos;
+    iov[0].iov_len = n;
+    if (n == len) {
+        return 1;
+    }
+    iov[1].iov_base = pcb->sbuf.data;
+    iov[1].iov_len = len - n;
+    return 2;
+}
+
+/*
+ * NOTE: Walk the data of len bytes from off, it fills up to TCP_SBUF_IOV_MAX
+ *       iovecs (if iov is given) and returns the length they cover, which is
+ *       shorter than len only if the zero-copy data is fragmented.
+ */
+static size_t
+tcp_sbuf_walk(struct tcp_pcb *pcb, struct iovec *iov, int *iovcnt, size_t off, size_t len)
+{
+    struct tcp_sbuf_extent *extent;
+    struct iovec tmp[2];
+    size_t ring = 0, done = 0, n;
+    int cnt = 0, i, num;
+
+    if (!pcb->sbuf.extents) {
+        num = len ? tcp_sbuf_peek_ring(pcb, iov ? iov : tmp, off, len) : 0;
+        if (iovcnt) {
+            *iovcnt = num;
+        }
+        return len;
+    }
+    for (extent = pcb->sbuf.extents; extent && done < len; extent = extent->next) {
+        if (off >= extent->len) {
+            off -= extent->len;
+            if (!extent->data) {
+                ring += extent->len;
+            }
+            continue;
+        }
+        n = MIN(len - done, extent->len - off);
+        if (extent->data) {
+            if (cnt == TCP_SBUF_IOV_MAX) {
+                break;
+            }
+            if (iov) {
+                iov[cnt].iov_base = (uint8_t *)extent->data + off;
+                iov[cnt].iov_len = n;
+            }
+            cnt++;
+        } else {
+            if (cnt + 2 > TCP_SBUF_IOV_MAX) {
+                break;
+            }
+            num = tcp_sbuf_peek_ring(pcb, tmp, ring + off, n);
+            for (i = 0; i < num; i++) {
+                if (iov) {
+                    iov[cnt] = tmp[i];
+                }
+                cnt++;
+            }
+            ring += extent->len;
+        }
+        off = 0;
+        done += n;
+    }
+    if (iovcnt) {
+        *iovcnt = cnt;
+    }
+    return done;
+}
+
+static int
+tcp_sbuf_peek(struct tcp_pcb *pcb, struct iovec *iov, size_t off, size_t len)
+{
+    int iovcnt;
+
+    tcp_sbuf_walk(pcb, iov, &iovcnt, off, len);
+    return iovcnt;
+}
+
+/* NOTE: the length of the data from off that a single segment can refer to */
+static size_t
+tcp_sbuf_span(struct tcp_pcb *pcb, size_t off, size_t len)
+{
+    return tcp_sbuf_walk(pcb, NULL, NULL, off, len);
+}
+
+static void
+tcp_sbuf_consume(struct tcp_pcb *pcb, size_t len)
+{
+    struct tcp_sbuf_extent *extent;
+    size_t n;
+
+    if (!pcb->sbuf.extents) {
+        pcb->sbuf.head = (pcb->sbuf.head + len) % pcb->sbuf.size;
+        pcb->sbuf.used -= len;
+        pcb->sbuf.len -= len;
+        return;
+    }
+    while (len && pcb->sbuf.extents) {
+        extent = pcb->sbuf.extents;
+        n = MIN(len, extent->len);
+        if (extent->data) {
+            extent->data += n;
+        } else {
+            pcb->sbuf.head = (pcb->sbuf.head + n) % pcb->sbuf.size;
+            pcb->sbuf.used -= n;
+        }
+        extent->len -= n;
+        pcb->sbuf.len -= n;
+        len -= n;
+        if (extent->len) {
+            break;
+        }
+        if (extent->notify) {
+            /* NOTE: the buffers of the user are released, reported by tcp_zerocopy_completed() */
+            pcb->zc.done = extent->notify;
+        }
+        pcb->sbuf.extents = extent->next;
+        if (!pcb->sbuf.extents) {
+            pcb->sbuf.tail = NULL;
+        }
+        memory_free(extent);
+    }
+}
+
+/* NOTE: a segment larger than MSS is a super-segment, it is split by GSO (see gso.c) */
+static uint16_t
+tcp_gso_size(struct tcp_pcb *pcb, size_t len)
+{
+    return (pcb->mss && len > pcb->mss) ? pcb->mss : 0;
+}
+
+/*
+ * TCP Retransmit
+ *
+ * NOTE: A single timer per connection covers the oldest outstanding segment,
+ *       the timeout is estimated from the RTT samples (RFC 6298). The loss is
+ *       also detected by the duplicate ACKs and the SACK scoreboard (RFC 6675).
+ *       In either recovery only the holes are retransmitted, within the
+ *       congestion window; the queue entries keep the send times for the RTT.
+ * NOTE: TCP Retransmit functions must be called after mutex locked
+ */
+
+static void
+tcp_rto_set(struct tcp_pcb *pcb)
+{
+    unsigned int rto = TCP_RTO_INITIAL;
+
+    if (pcb->rtx.srtt) {
+        rto = pcb->rtx.srtt + MAX(TCP_TIMER_INTERVAL, 4 * pcb->rtx.rttvar);
+    }
+    pcb->rtx.rto = MIN(MAX(rto, pcb->rtx.rto_min), TCP_RTO_MAX);
+}
+
+/* rfc6298 - section 2 */
+static void
+tcp_rtt_update(struct tcp_pcb *pcb, uint32_t rtt)
+{
+    uint32_t delta;
+
+    if (!rtt) {
+        rtt = 1;
+    }
+    if (!pcb->rtx.srtt) {
+        /* the first measurement */
+        pcb->rtx.srtt = rtt;
+        pcb->rtx.rttvar = rtt / 2;
+    } else {
+        delta = pcb->rtx.srtt > rtt ? pcb->rtx.srtt - rtt : rtt - pcb->rtx.srtt;
+        pcb->rtx.rttvar = (3 * pcb->rtx.rttvar + delta) / 4;
+        pcb->rtx.srtt = (7 * pcb->rtx.srtt + rtt) / 8;
+    }
+    tcp_rto_set(pcb);
+    pcb->cc.srtt = pcb->rtx.srtt;
+    debugf("rtt=%u, srtt=%u, rttvar=%u, rto=%u", rtt, pcb->rtx.srtt, pcb->rtx.rttvar, pcb->rtx.rto);
+}
+
+static void
+tcp_retransmit_timer_set(struct tcp_pcb *pcb)
+{
+    unsigned int rto;
+    unsigned int i;
+
+    rto = pcb->rtx.rto;
+    for (i = 0; i < pcb->rtx.backoff && rto < TCP_RTO_MAX; i++) {
+        rto *= 2;
+    }
+    gettimeofday(&pcb->rtx.expire, NULL);
+    timeval_add_usec(&pcb->rtx.expire, MIN(rto, TCP_RTO_MAX));
+    tcp_pcb_timer_update(pcb);
+}
+
+static int
+tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, size_t len)
+{
+    struct tcp_queue_entry *entry;
+
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->seq = seq;
+    entry->flg = flg;
     entry->len = len;
-    memcpy(entry + 1, data, entry->len);
     gettimeofday(&entry->first, NULL);
     entry->last = entry->first;
     if (!queue_push(&pcb->queue, entry)) {
@@ -275,128 +1895,1004 @@ tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t
         memory_free(entry);
         return -1;
     }
-    return 0;
+    if (!timerisset(&pcb->rtx.expire)) {
+        tcp_retransmit_timer_set(pcb);
+    }
+    return 0;
+}
+
+/* NOTE: called when snd.una advanced */
+/* NOTE: tsecr is the timestamp echoed by the ACK (0: none) */
+static void
+tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb, uint32_t tsecr)
+{
+    struct tcp_queue_entry *entry;
+    struct timeval sent = {}, now, diff;
+    int ambiguous = 0;
+
+    while ((entry = queue_peek(&pcb->queue))) {
+        if (TCP_SEQ_LT(pcb->snd.una, entry->seq + entry->len + TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN | TCP_FLG_FIN))) {
+            /* not fully acknowledged */
+            break;
+        }
+        entry = queue_pop(&pcb->queue);
+        debugf("remove, seq=%u, flags=%s, len=%u", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
+        if (entry->retransmitted) {
+            ambiguous = 1;
+        } else {
+            sent = entry->first;
+        }
+        memory_free(entry);
+    }
+    if (timerisset(&sent) && !ambiguous) {
+        /* NOTE: no sample from an ACK which covers a retransmitted segment (Karn's algorithm) */
+        gettimeofday(&now, NULL);
+        timersub(&now, &sent, &diff);
+        tcp_rtt_update(pcb, diff.tv_sec * 1000000 + diff.tv_usec);
+    } else if (tsecr && (int32_t)(tcp_pcb_tsval(pcb) - tsecr) >= 0) {
+        /* NOTE: the echoed timestamp identifies the transmission, even a retransmitted one (rfc7323 - section 4.1) */
+        tcp_rtt_update(pcb, (tcp_pcb_tsval(pcb) - tsecr) * 1000);
+    }
+    tcp_sack_trim(pcb);
+    if (!TCP_SEQ_LT(pcb->snd.una, pcb->rtx.recover)) {
+        pcb->flags &= ~(TCP_PCB_FLG_RECOVERY | TCP_PCB_FLG_LOSS);
+    }
+    pcb->rtx.dupacks = 0;
+    /* rfc6298 - section 5.2, 5.3 (and the backoff is cleared by the new ACK) */
+    pcb->rtx.backoff = 0;
+    if (pcb->queue.num) {
+        tcp_retransmit_timer_set(pcb);
+    } else {
+        timerclear(&pcb->rtx.expire);
+    }
+    return;
+}
+
+/* NOTE: for the SYN, which has no data in the send buffer */
+static void
+tcp_retransmit_entry(struct tcp_pcb *pcb, struct tcp_queue_entry *entry, struct timeval *now)
+{
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
+
+    optlen = tcp_options_build(pcb, entry->flg, 0, opt);
+    tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, tcp_pcb_window(pcb, entry->flg), opt, optlen, NULL, 0, 0, &pcb->local, &pcb->foreign);
+    entry->last = *now;
+    entry->retransmitted = 1;
+}
+
+static void
+tcp_retransmit_mark(void *arg, void *data)
+{
+    struct tcp_range *range;
+    struct tcp_queue_entry *entry;
+
+    range = (struct tcp_range *)arg;
+    entry = (struct tcp_queue_entry *)data;
+    if (TCP_SEQ_LT(entry->seq, range->end) && TCP_SEQ_LT(range->seq, entry->seq + entry->len + TCP_FLG_ISSET(entry->flg, TCP_FLG_FIN))) {
+        gettimeofday(&entry->last, NULL);
+        entry->retransmitted = 1;
+    }
+}
+
+/* NOTE: returns the sequence space sent (the FIN is included if the range reaches it) */
+static uint32_t
+tcp_retransmit_data(struct tcp_pcb *pcb, uint32_t seq, size_t len)
+{
+    struct tcp_range range;
+    size_t avail;
+    uint8_t flg = TCP_FLG_ACK;
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
+    struct iovec iov[TCP_SBUF_IOV_MAX];
+    int iovcnt;
+
+    avail = pcb->sbuf.len - (seq - pcb->snd.una);
+    if (len > avail) {
+        len = avail;
+        if (pcb->flags & TCP_PCB_FLG_FIN_SENT) {
+            flg |= TCP_FLG_FIN;
+        }
+    }
+    if (tcp_sbuf_span(pcb, seq - pcb->snd.una, len) < len) {
+        /* NOTE: the rest (and FIN) goes in the next segment */
+        len = tcp_sbuf_span(pcb, seq - pcb->snd.una, len);
+        flg &= ~TCP_FLG_FIN;
+    }
+    if (!len && !TCP_FLG_ISSET(flg, TCP_FLG_FIN)) {
+        return 0;
+    }
+    debugf("seq=%u, len=%zu, flags=%s", seq, len, tcp_flg_ntoa(flg));
+    iovcnt = tcp_sbuf_peek(pcb, iov, seq - pcb->snd.una, len);
+    tcp_delack_clear(pcb);
+    optlen = tcp_options_build(pcb, flg, len, opt);
+    tcp_output_segment(seq, pcb->rcv.nxt, flg, tcp_pcb_window(pcb, flg), opt, optlen, iov, iovcnt, tcp_gso_size(pcb, len), &pcb->local, &pcb->foreign);
+    range.seq = seq;
+    range.end = seq + len + TCP_FLG_ISSET(flg, TCP_FLG_FIN);
+    queue_foreach(&pcb->queue, tcp_retransmit_mark, &range);
+    return range.end - range.seq;
+}
+
+/*
+ * rfc3522 - section 2 (the Eifel detection algorithm)
+ *
+ * NOTE: The TSval of the first retransmission is kept with the window before
+ *       the reduction. If the first ACK for new data echoes an older TSval it
+ *       was sent for the original transmission, the retransmission was spurious.
+ */
+static void
+tcp_retransmit_eifel_start(struct tcp_pcb *pcb)
+{
+    if (!(pcb->flags & TCP_PCB_FLG_TS) || pcb->ts.eifel) {
+        return;
+    }
+    pcb->ts.eifel = 1;
+    pcb->ts.retransmitted = tcp_pcb_tsval(pcb);
+    tcp_cc_save(&pcb->cc);
+}
+
+/* NOTE: called on the first ACK for new data after the retransmission */
+static void
+tcp_retransmit_eifel_check(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    pcb->ts.eifel = 0;
+    if (!seg->ts_ok || !TCP_SEQ_LT(seg->tsecr, pcb->ts.retransmitted)) {
+        return;
+    }
+    debugf("spurious retransmission, una=%u, tsecr=%u, retransmitted=%u", pcb->snd.una, seg->tsecr, pcb->ts.retransmitted);
+    tcp_cc_undo(&pcb->cc);
+    pcb->flags &= ~(TCP_PCB_FLG_RECOVERY | TCP_PCB_FLG_LOSS);
+    pcb->rtx.backoff = 0;
+}
+
+/* rfc6675 - section 5 (NextSeg, rule 1 only) */
+static void
+tcp_retransmit_holes(struct tcp_pcb *pcb)
+{
+    struct tcp_range *range;
+    uint32_t pipe, end, n;
+    size_t len;
+
+    pcb->rtx.high = TCP_SEQ_MAX(pcb->rtx.high, pcb->snd.una);
+    while (TCP_SEQ_LT(pcb->rtx.high, pcb->rtx.lost)) {
+        for (range = pcb->sack; range && TCP_SEQ_LEQ(range->end, pcb->rtx.high); range = range->next);
+        if (range && TCP_SEQ_LEQ(range->seq, pcb->rtx.high)) {
+            /* SACKed, skip it */
+            pcb->rtx.high = range->end;
+            continue;
+        }
+        end = (range && TCP_SEQ_LT(range->seq, pcb->rtx.lost)) ? range->seq : pcb->rtx.lost;
+        pipe = tcp_pipe(pcb);
+        if (pipe >= pcb->cc.cwnd) {
+            break;
+        }
+        len = MIN(MIN(end - pcb->rtx.high, pcb->cc.cwnd - pipe), MIN(pcb->mss * GSO_SEGS_MAX, TCP_GSO_SIZE_MAX));
+        n = tcp_retransmit_data(pcb, pcb->rtx.high, len);
+        if (!n) {
+            break;
+        }
+        pcb->rtx.high += n;
+    }
+}
+
+/* rfc6298 - section 5.4, 5.5, 5.6 */
+static void
+tcp_retransmit_timeout(struct tcp_pcb *pcb, struct timeval *now)
+{
+    struct tcp_queue_entry *entry;
+    struct timeval diff;
+
+    if (!timerisset(&pcb->rtx.expire) || timercmp(now, &pcb->rtx.expire, <)) {
+        return;
+    }
+    entry = queue_peek(&pcb->queue);
+    if (!entry) {
+        timerclear(&pcb->rtx.expire);
+        return;
+    }
+    timersub(now, &entry->first, &diff);
+    if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE) {
+        timerclear(&pcb->rtx.expire);
+        switch (pcb->state) {
+        case TCP_PCB_STATE_FIN_WAIT1:
+        case TCP_PCB_STATE_FIN_WAIT2:
+        case TCP_PCB_STATE_CLOSING:
+        case TCP_PCB_STATE_LAST_ACK:
+            /* NOTE: already closed by the user, no one releases it later */
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+            break;
+        default:
+            /* NOTE: released by tcp_close() */
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            sched_wakeup(&pcb->ctx);
+            break;
+        }
+        return;
+    }
+    if (TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN) || !pcb->sbuf.data) {
+        tcp_retransmit_entry(pcb, entry, now);
+    } else {
+        debugf("timeout, una=%u, nxt=%u, backoff=%u", pcb->snd.una, pcb->snd.nxt, pcb->rtx.backoff);
+        tcp_retransmit_eifel_start(pcb);
+        pcb->cc.ops->on_rto(&pcb->cc, pcb->snd.nxt - pcb->snd.una);
+        /* NOTE: the receiver may have discarded the SACKed data (RFC 2018 section 8) */
+        tcp_range_clear(&pcb->sack, &pcb->sack_num);
+        pcb->sacked = 0;
+        pcb->flags &= ~TCP_PCB_FLG_RECOVERY;
+        pcb->flags |= TCP_PCB_FLG_LOSS;
+        pcb->rtx.recover = pcb->snd.nxt;
+        pcb->rtx.lost = pcb->snd.nxt;
+        pcb->rtx.high = pcb->snd.una;
+        pcb->rtx.dupacks = 0;
+        tcp_retransmit_holes(pcb);
+    }
+    pcb->rtx.backoff++;
+    tcp_retransmit_timer_set(pcb);
+}
+
+/*
+ * NOTE: called on every ACK, it starts the fast recovery on the third duplicate
+ *       ACK or when DupThresh segments are SACKed above snd.una, and sends the
+ *       holes as far as the congestion window allows.
+ */
+static void
+tcp_retransmit_recover(struct tcp_pcb *pcb)
+{
+    struct timeval now;
+    uint32_t lost;
+
+    if (!(pcb->flags & (TCP_PCB_FLG_RECOVERY | TCP_PCB_FLG_LOSS))) {
+        if (pcb->snd.una == pcb->snd.nxt || !pcb->cc.mss) {
+            return;
+        }
+        if (pcb->rtx.dupacks < TCP_DUPTHRESH && pcb->sacked < TCP_DUPTHRESH * pcb->mss) {
+            return;
+        }
+        debugf("fast retransmit, una=%u, nxt=%u, dupacks=%u, sacked=%u", pcb->snd.una, pcb->snd.nxt, pcb->rtx.dupacks, pcb->sacked);
+        gettimeofday(&now, NULL);
+        tcp_retransmit_eifel_start(pcb);
+        pcb->cc.ops->on_loss(&pcb->cc, pcb->snd.nxt - pcb->snd.una, &now);
+        pcb->flags |= TCP_PCB_FLG_RECOVERY;
+        pcb->rtx.recover = pcb->snd.nxt;
+        pcb->rtx.lost = pcb->snd.una;
+        pcb->rtx.high = pcb->snd.una;
+    }
+    if (pcb->flags & TCP_PCB_FLG_RECOVERY) {
+        /* NOTE: the first unacknowledged segment is lost (on entering and on a partial ACK) */
+        lost = TCP_SEQ_MAX(tcp_sack_fack(pcb), pcb->snd.una + pcb->mss);
+        if (TCP_SEQ_LT(pcb->rtx.recover, lost)) {
+            lost = pcb->rtx.recover;
+        }
+        pcb->rtx.lost = TCP_SEQ_MAX(pcb->rtx.lost, lost);
+    }
+    tcp_retransmit_holes(pcb);
+}
+
+static void
+tcp_set_timewait_timer(struct tcp_pcb *pcb)
+{
+    gettimeofday(&pcb->tw_timer, NULL);
+    pcb->tw_timer.tv_sec += TCP_TIMEWAIT_SEC;
+    tcp_pcb_timer_update(pcb);
+    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
+}
+
+/*
+ * TCP Output Queue
+ *
+ * NOTE: The segments are built while the PCB is locked, but transmitted after
+ *       unlocking it (see tcp_pcb_unlock()), so that the locks are not held
+ *       across the device output. The queue is per thread, no lock is needed.
+ */
+
+/* NOTE: it returns the length of the data queued, the transmission itself may fail later */
+static ssize_t
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, const uint8_t *opt, size_t optlen, const struct iovec *iov, int iovcnt, uint16_t gso_size, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_output_entry *entry;
+    struct tcp_hdr *hdr;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    entry = memory_alloc(sizeof(*entry) + IP_OUTPUT_HEADROOM + sizeof(*hdr) + optlen + len);
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->local = *local;
+    entry->foreign = *foreign;
+    entry->len = sizeof(*hdr) + optlen + len;
+    entry->gso_size = gso_size;
+    hdr = (struct tcp_hdr *)((uint8_t *)(entry + 1) + IP_OUTPUT_HEADROOM);
+    hdr->src = local->port;
+    hdr->dst = foreign->port;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->wnd = hton16(wnd);
+    hdr->sum = 0;
+    hdr->up = 0;
+    memcpy(hdr + 1, opt, optlen);
+    for (i = 0, len = 0; i < iovcnt; i++) {
+        memcpy((uint8_t *)(hdr + 1) + optlen + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    if (!queue_push(&output, entry)) {
+        errorf("queue_push() failure");
+        memory_free(entry);
+        return -1;
+    }
+    return len;
 }
 
+/* NOTE: must be called after the locks unlocked */
 static void
-tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
+tcp_output_flush(void)
 {
-    struct tcp_queue_entry *entry;
+    struct tcp_output_entry *entry;
+    struct tcp_hdr *hdr;
+    struct pseudo_hdr pseudo;
+    uint16_t psum;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
 
-    while ((entry = queue_peek(&pcb->queue))) {
-        if (entry->seq >= pcb->snd.una) {
-            break;
+    while ((entry = queue_pop(&output)) != NULL) {
+        hdr = (struct tcp_hdr *)((uint8_t *)(entry + 1) + IP_OUTPUT_HEADROOM);
+        pseudo.src = entry->local.addr;
+        pseudo.dst = entry->foreign.addr;
+        pseudo.zero = 0;
+        pseudo.protocol = IP_PROTOCOL_TCP;
+        pseudo.len = hton16(entry->len);
+        psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
+        if (!entry->gso_size) {
+            hdr->sum = cksum16((uint16_t *)hdr, entry->len, psum);
+        } /* else: the checksum is computed by GSO for each frame */
+        debugf("%s => %s, len=%zu (payload=%zu, gso_size=%u)",
+            ip_endpoint_ntop(&entry->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&entry->foreign, ep2, sizeof(ep2)),
+            entry->len, entry->len - ((hdr->off >> 4) << 2), entry->gso_size);
+        tcp_dump((uint8_t *)hdr, entry->len);
+        /* NOTE: the IP header and the frames are built in place, no more copy of the payload */
+        if (ip_output_headroom(IP_PROTOCOL_TCP, (uint8_t *)hdr, entry->len, entry->local.addr, entry->foreign.addr, entry->gso_size) == -1) {
+            errorf("ip_output_headroom() failure");
         }
-        entry = queue_pop(&pcb->queue);
-        debugf("remove, seq=%u, flags=%s, len=%u", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
         memory_free(entry);
     }
-    return;
 }
 
-static void
-tcp_retransmit_queue_emit(void *arg, void *data)
+/* NOTE: the data of the segment is len bytes from snd.nxt in the send buffer */
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg, size_t len)
+{
+    uint32_t seq;
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
+    struct iovec iov[TCP_SBUF_IOV_MAX];
+    int iovcnt;
+
+    seq = pcb->snd.nxt;
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        seq = pcb->iss;
+    }
+    iovcnt = tcp_sbuf_peek(pcb, iov, pcb->snd.nxt - pcb->snd.una, len);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
+        tcp_retransmit_queue_add(pcb, seq, flg, len);
+    }
+    pcb->rcv.adv = pcb->rcv.wnd;
+    if (TCP_FLG_ISSET(flg, TCP_FLG_ACK)) {
+        /* NOTE: the pending ACK rides on this segment */
+        tcp_delack_clear(pcb);
+    }
+    optlen = tcp_options_build(pcb, flg, len, opt);
+    return tcp_output_segment(seq, pcb->rcv.nxt, flg, tcp_pcb_window(pcb, flg), opt, optlen, iov, iovcnt, tcp_gso_size(pcb, len), &pcb->local, &pcb->foreign);
+}
+
+/*
+ * TCP Delayed ACK
+ *
+ * NOTE: The ACK for the in-order data is held until TCP_DELACK_SEGS full-sized
+ *       segments are received or TCP_DELACK_TIMEOUT elapses (RFC 1122 4.2.3.2),
+ *       and any segment sent meanwhile carries it. A GRO super-segment counts by
+ *       its bytes, so it is answered by a single (stretch) ACK.
+ * NOTE: TCP Delayed ACK functions must be called after mutex locked
+ */
+
+static void
+tcp_delack_clear(struct tcp_pcb *pcb)
+{
+    pcb->delack.pending = 0;
+    timerclear(&pcb->delack.expire);
+}
+
+/* NOTE: called for the received text, the ACK is sent at once if quick is set */
+static void
+tcp_delack(struct tcp_pcb *pcb, size_t len, int quick)
+{
+    pcb->delack.pending += len;
+    /* NOTE: not beyond the half of the buffer, the sender would stall on the window */
+    if (pcb->delack.pending >= MIN(TCP_DELACK_SEGS * pcb->mss, pcb->rbuf.size / 2)) {
+        quick = 1;
+    }
+    if (quick || (pcb->flags & TCP_PCB_FLG_QUICKACK)) {
+        tcp_output(pcb, TCP_FLG_ACK, 0);
+        return;
+    }
+    if (!timerisset(&pcb->delack.expire)) {
+        gettimeofday(&pcb->delack.expire, NULL);
+        timeval_add_usec(&pcb->delack.expire, TCP_DELACK_TIMEOUT);
+        tcp_pcb_timer_update(pcb);
+    }
+}
+
+static void
+tcp_persist_start(struct tcp_pcb *pcb)
+{
+    if (timerisset(&pcb->persist.expire)) {
+        return;
+    }
+    if (!pcb->persist.timeout) {
+        pcb->persist.timeout = TCP_PERSIST_TIMEOUT_MIN;
+    }
+    gettimeofday(&pcb->persist.expire, NULL);
+    timeval_add_usec(&pcb->persist.expire, pcb->persist.timeout);
+    tcp_pcb_timer_update(pcb);
+}
+
+static void
+tcp_persist_stop(struct tcp_pcb *pcb)
+{
+    timerclear(&pcb->persist.expire);
+    pcb->persist.timeout = 0;
+}
+
+/*
+ * NOTE: Send the buffered data as far as the window allows, it is called on write,
+ *       on ACK arrival and on option changes. A partial segment is held while corked,
+ *       while more data is announced, or while unacknowledged data is outstanding
+ *       (Nagle's algorithm, RFC 896) unless TCP_OPT_NODELAY is set.
+ */
+static void
+tcp_transmit(struct tcp_pcb *pcb)
+{
+    size_t flight, unsent, wnd, pipe, cwnd, len;
+    uint32_t edge;
+    uint64_t rate;
+    uint8_t flg;
+
+    if (pcb->flags & TCP_PCB_FLG_FIN_SENT) {
+        return;
+    }
+    while (1) {
+        flight = pcb->snd.nxt - pcb->snd.una;
+        unsent = flight < pcb->sbuf.len ? pcb->sbuf.len - flight : 0;
+        if (!unsent) {
+            break;
+        }
+        /* NOTE: the window is offered from snd.wl2 (it is not updated by every ACK advancing snd.una) */
+        edge = pcb->snd.wl2 + pcb->snd.wnd;
+        wnd = TCP_SEQ_LT(pcb->snd.nxt, edge) ? edge - pcb->snd.nxt : 0;
+        if (!wnd) {
+            if (!flight) {
+                /* nothing will be acknowledged, probe the window */
+                tcp_persist_start(pcb);
+            }
+            return;
+        }
+        tcp_persist_stop(pcb);
+        pipe = tcp_pipe(pcb);
+        cwnd = pcb->cc.cwnd > pipe ? pcb->cc.cwnd - pipe : 0;
+        if (!cwnd) {
+            /* limited by the congestion window, the ACKs will open it */
+            return;
+        }
+        wnd = MIN(wnd, cwnd);
+        /* emit a super-segment of up to GSO_SEGS_MAX * MSS bytes at once */
+        len = MIN(MIN(unsent, wnd), MIN(pcb->mss * GSO_SEGS_MAX, TCP_GSO_SIZE_MAX));
+        len = tcp_sbuf_span(pcb, flight, len);
+        rate = tcp_cc_pacing_rate(&pcb->cc);
+        if (rate) {
+            /* NOTE: do not burst more than the pacing rate allows in a millisecond */
+            len = MIN(len, MAX(2 * pcb->mss, rate / 1000 / pcb->mss * pcb->mss));
+        }
+        if (len < pcb->mss) {
+            if (pcb->flags & (TCP_PCB_FLG_CORK | TCP_PCB_FLG_MORE)) {
+                return;
+            }
+            if (len < unsent) {
+                /* limited by the window, wait for it to open unless nothing is outstanding */
+                if (flight) {
+                    return;
+                }
+            } else if (flight && !(pcb->flags & TCP_PCB_FLG_NODELAY)) {
+                return;
+            }
+        }
+        flg = TCP_FLG_ACK;
+        if (len == unsent) {
+            flg |= TCP_FLG_PSH;
+        }
+        if (tcp_output(pcb, flg, len) == -1) {
+            /* NOTE: it is queued for the retransmission anyway */
+            errorf("tcp_output() failure");
+        }
+        pcb->snd.nxt += len;
+    }
+    if (pcb->flags & TCP_PCB_FLG_FIN) {
+        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, 0);
+        pcb->snd.nxt++;
+        pcb->flags |= TCP_PCB_FLG_FIN_SENT;
+    }
+}
+
+/* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
+/*
+ * TCP SYN Queue
+ *
+ * NOTE: A SYN to a listener in the socket mode makes a small entry instead of a PCB.
+ *       The PCB is allocated by the ACK of the SYN-ACK and pushed to the accept queue,
+ *       bounded by the backlog. While the entries run out, the state is carried by
+ *       the ISS of the SYN-ACK instead (SYN cookies, RFC 4987), at the cost of the
+ *       window scale, SACK and timestamps options. A listener accepts cookies only
+ *       for TCP_SYNCOOKIE_VALID seconds after it sent one.
+ * NOTE: TCP SYN Queue functions must be called after mutex locked, except the
+ *       ones taking a listener, which must be called after the listener locked
+ */
+
+/* NOTE: the MSS encoded in a SYN cookie, the largest one not exceeding the MSS option is chosen */
+static const uint16_t syncookie_mss[] = {536, 1200, 1400, 1440, 1460, 4312, 8960, 65495};
+
+static unsigned int
+tcp_synq_index(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    return tcp_hash_key(TCP_HASH_CONN, local, foreign) & (TCP_SYNQ_SIZE - 1);
+}
+
+static struct tcp_syn_entry *
+tcp_synq_lookup(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_syn_entry *entry;
+
+    for (entry = synq_buckets[tcp_synq_index(local, foreign)]; entry; entry = entry->next) {
+        if (entry->local.addr == local->addr && entry->local.port == local->port &&
+            entry->foreign.addr == foreign->addr && entry->foreign.port == foreign->port) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void
+tcp_synq_timer_set(struct tcp_syn_entry *entry, struct timeval *now)
+{
+    struct timeval expire;
+
+    expire = *now;
+    timeval_add_usec(&expire, (TCP_RTO_INITIAL << entry->retries));
+    tcp_timer_wheel_insert(&synq_timers, &entry->timer, &expire);
+}
+
+static struct tcp_syn_entry *
+tcp_synq_alloc(struct tcp_pcb *listener, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_syn_entry *entry;
+    unsigned int index;
+
+    entry = synq_freelist;
+    if (!entry) {
+        return NULL;
+    }
+    synq_freelist = entry->next;
+    entry->listener = listener;
+    entry->local = *local;
+    entry->foreign = *foreign;
+    entry->syn = *seg;
+    entry->wnd = MIN(listener->rbuf.size, 0xffff);
+    entry->wscale = seg->wscale_ok ? tcp_pcb_wscale(listener) : 0;
+    entry->iss = random();
+    entry->ts_offset = random();
+    gettimeofday(&entry->sent, NULL);
+    tcp_synq_timer_set(entry, &entry->sent);
+    index = tcp_synq_index(local, foreign);
+    entry->next = synq_buckets[index];
+    synq_buckets[index] = entry;
+    listener->synq_num++;
+    synq_num++;
+    return entry;
+}
+
+static void
+tcp_synq_free(struct tcp_syn_entry *entry)
+{
+    struct tcp_syn_entry **p;
+
+    for (p = &synq_buckets[tcp_synq_index(&entry->local, &entry->foreign)]; *p; p = &(*p)->next) {
+        if (*p == entry) {
+            *p = entry->next;
+            break;
+        }
+    }
+    entry->listener->synq_num--;
+    synq_num--;
+    tcp_timer_wheel_remove(&synq_timers, &entry->timer);
+    memset(entry, 0, sizeof(*entry));
+    entry->next = synq_freelist;
+    synq_freelist = entry;
+}
+
+static void
+tcp_synq_purge(struct tcp_pcb *listener)
+{
+    unsigned int i;
+
+    for (i = 0; i < TCP_SYNQ_SIZE && listener->synq_num; i++) {
+        if (synq[i].listener == listener) {
+            tcp_synq_free(&synq[i]);
+        }
+    }
+}
+
+/* NOTE: the SYN-ACK accepts the options offered by the SYN */
+static void
+tcp_synq_output(struct tcp_syn_entry *entry)
+{
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
+    uint16_t flags = 0;
+
+    if (entry->syn.wscale_ok) {
+        flags |= TCP_PCB_FLG_WSCALE;
+    }
+    if (entry->syn.sack_perm) {
+        flags |= TCP_PCB_FLG_SACK;
+    }
+    if (entry->syn.ts_ok) {
+        flags |= TCP_PCB_FLG_TS;
+    }
+    optlen = tcp_options_syn(opt, tcp_local_mss(&entry->local), flags, entry->wscale, tcp_clock() + entry->ts_offset, entry->syn.tsval);
+    tcp_output_segment(entry->iss, entry->syn.seq + 1, TCP_FLG_SYN | TCP_FLG_ACK, entry->wnd,
+        opt, optlen, NULL, 0, 0, &entry->local, &entry->foreign);
+}
+
+static void
+tcp_synq_expire(struct tcp_timer_link *link, void *arg)
+{
+    struct tcp_syn_entry *entry;
+    char ep[IP_ENDPOINT_STR_LEN];
+
+    entry = (struct tcp_syn_entry *)((uint8_t *)link - offsetof(struct tcp_syn_entry, timer));
+    if (entry->retries >= TCP_SYNACK_RETRIES) {
+        debugf("no ACK for the SYN-ACK, foreign=%s", ip_endpoint_ntop(&entry->foreign, ep, sizeof(ep)));
+        tcp_synq_free(entry);
+        return;
+    }
+    entry->retries++;
+    tcp_synq_output(entry);
+    tcp_synq_timer_set(entry, arg);
+}
+
+static void
+tcp_synq_timer(struct timeval *now)
+{
+    tcp_timer_wheel_expire(&synq_timers, now, tcp_synq_expire, now);
+}
+
+static uint32_t
+tcp_syncookie_count(void)
+{
+    return tcp_clock() / 1000 / TCP_SYNCOOKIE_PERIOD;
+}
+
+/* NOTE: the secret of the period, created on the first use if create is set (NULL: not available) */
+static const uint8_t *
+tcp_syncookie_key(uint32_t count, int create)
+{
+    int i;
+
+    i = count & 0x01;
+    if (!syncookie_keys[i].valid || syncookie_keys[i].count != count) {
+        if (!create) {
+            return NULL;
+        }
+        if (random_bytes(syncookie_keys[i].key, sizeof(syncookie_keys[i].key)) == -1) {
+            errorf("random_bytes() failure");
+            syncookie_keys[i].valid = 0;
+            return NULL;
+        }
+        syncookie_keys[i].count = count;
+        syncookie_keys[i].valid = 1;
+    }
+    return syncookie_keys[i].key;
+}
+
+static uint32_t
+tcp_syncookie_hash(const uint8_t *secret, struct ip_endpoint *local, struct ip_endpoint *foreign, uint32_t irs, uint32_t count)
+{
+    struct {
+        ip_addr_t laddr;
+        ip_addr_t faddr;
+        uint16_t lport;
+        uint16_t fport;
+        uint32_t irs;
+        uint32_t count;
+    } key;
+
+    memset(&key, 0, sizeof(key));
+    key.laddr = local->addr;
+    key.faddr = foreign->addr;
+    key.lport = local->port;
+    key.fport = foreign->port;
+    key.irs = irs;
+    key.count = count;
+    return (uint32_t)siphash24(secret, &key, sizeof(key));
+}
+
+/*
+ * NOTE: The cookie is the ISS of the SYN-ACK: 5 bits of the period counter, 3 bits
+ *       of the MSS index and 24 bits of SipHash keyed by the secret of the period
+ *       over the 4-tuple, the IRS and the counter (rfc4987 - section 3.6).
+ */
+static int
+tcp_syncookie_make(struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign, uint32_t *cookie)
+{
+    uint16_t mss;
+    uint32_t index = 0, count;
+    const uint8_t *secret;
+
+    mss = seg->mss ? seg->mss : TCP_DEFAULT_MSS;
+    while (index + 1 < countof(syncookie_mss) && syncookie_mss[index + 1] <= mss) {
+        index++;
+    }
+    count = tcp_syncookie_count();
+    secret = tcp_syncookie_key(count, 1);
+    if (!secret) {
+        return -1;
+    }
+    *cookie = ((count & 0x1f) << 27) | (index << 24) | (tcp_syncookie_hash(secret, local, foreign, seg->seq, count) & 0x00ffffff);
+    return 0;
+}
+
+/* NOTE: returns the MSS encoded in the cookie (0: not a valid cookie) */
+static uint16_t
+tcp_syncookie_check(uint32_t cookie, uint32_t irs, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    uint32_t count;
+    const uint8_t *secret;
+    int i;
+
+    count = tcp_syncookie_count();
+    for (i = 0; i < 2; i++, count--) {
+        if ((cookie >> 27) != (count & 0x1f)) {
+            continue;
+        }
+        secret = tcp_syncookie_key(count, 0);
+        if (secret && (cookie & 0x00ffffff) == (tcp_syncookie_hash(secret, local, foreign, irs, count) & 0x00ffffff)) {
+            return syncookie_mss[(cookie >> 24) & 0x07];
+        }
+    }
+    return 0;
+}
+
+/* NOTE: the cookies are accepted only shortly after the SYN queue overflowed (called with the listener locked) */
+static int
+tcp_syncookie_recent(struct tcp_pcb *listener)
+{
+    return listener->syncookie_sent && tcp_clock() - listener->syncookie_sent < TCP_SYNCOOKIE_VALID * 1000;
+}
+
+static void
+tcp_synq_syn(struct tcp_pcb *listener, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_syn_entry *entry;
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
+    uint32_t cookie;
+    char ep[IP_ENDPOINT_STR_LEN];
+
+    mutex_lock(&mutex);
+    entry = tcp_synq_lookup(local, foreign);
+    if (entry) {
+        if (entry->listener == listener && entry->syn.seq == seg->seq) {
+            /* NOTE: a retransmitted SYN, the SYN-ACK might be lost */
+            tcp_synq_output(entry);
+        }
+        mutex_unlock(&mutex);
+        return;
+    }
+    if (listener->backlog.num >= listener->backlog_max) {
+        /* NOTE: the peer retries it, the connection could not be queued now */
+        debugf("accept queue is full, drop SYN, foreign=%s", ip_endpoint_ntop(foreign, ep, sizeof(ep)));
+        mutex_unlock(&mutex);
+        return;
+    }
+    entry = tcp_synq_alloc(listener, seg, local, foreign);
+    if (!entry) {
+        if (tcp_syncookie_make(seg, local, foreign, &cookie) == -1) {
+            mutex_unlock(&mutex);
+            errorf("tcp_syncookie_make() failure");
+            return;
+        }
+        mutex_unlock(&mutex);
+        listener->syncookie_sent = MAX(tcp_clock(), 1); /* NOTE: 0 means never */
+        debugf("SYN queue is full, send a SYN cookie, foreign=%s", ip_endpoint_ntop(foreign, ep, sizeof(ep)));
+        optlen = tcp_options_syn(opt, tcp_local_mss(local), 0, 0, 0, 0);
+        tcp_output_segment(cookie, seg->seq + 1, TCP_FLG_SYN | TCP_FLG_ACK, MIN(listener->rbuf.size, 0xffff),
+            opt, optlen, NULL, 0, 0, local, foreign);
+        return;
+    }
+    tcp_synq_output(entry);
+    mutex_unlock(&mutex);
+}
+
+/*
+ * NOTE: The child taken from the accept queue (the entry is freed), it returns
+ *       the PCB locked, or NULL if it was released (and reused) meanwhile.
+ * NOTE: called with the listener locked
+ */
+static struct tcp_pcb *
+tcp_backlog_child(struct tcp_pcb *listener, struct tcp_backlog_entry *backlog)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = backlog->pcb;
+    mutex_lock(&pcb->mutex);
+    if (pcb->state == TCP_PCB_STATE_FREE || pcb->parent != listener || pcb->gen != backlog->gen) {
+        mutex_unlock(&pcb->mutex);
+        pcb = NULL;
+    }
+    memory_free(backlog);
+    return pcb;
+}
+
+/*
+ * NOTE: The connection enters the ESTABLISHED state directly, sent is the SYN-ACK for
+ *       the RTT sample (NULL: none). The PCB is returned locked.
+ */
+static struct tcp_pcb *
+tcp_synq_establish(struct tcp_pcb *listener, struct tcp_segment_info *syn, uint32_t iss, uint32_t ts_offset, struct timeval *sent,
+    struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb;
-    struct tcp_queue_entry *entry;
-    struct timeval now, diff, timeout;
+    struct tcp_backlog_entry *backlog;
+    struct timeval now, diff;
 
-    pcb = (struct tcp_pcb *)arg;
-    entry = (struct tcp_queue_entry *)data;
-    gettimeofday(&now, NULL);
-    timersub(&now, &entry->first, &diff);
-    if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE) {
+    backlog = memory_alloc(sizeof(*backlog));
+    if (!backlog) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    pcb = tcp_pcb_alloc();
+    if (!pcb) {
+        errorf("tcp_pcb_alloc() failure");
+        memory_free(backlog);
+        return NULL;
+    }
+    pcb->mode = TCP_PCB_MODE_SOCKET;
+    pcb->parent = listener;
+    pcb->rbuf.size = listener->rbuf.size;
+    pcb->rbuf.lowat = listener->rbuf.lowat;
+    pcb->sbuf.size = listener->sbuf.size;
+    pcb->flags = listener->flags & (TCP_PCB_FLG_NODELAY | TCP_PCB_FLG_CORK | TCP_PCB_FLG_QUICKACK | TCP_PCB_FLG_PUSHACK);
+    pcb->cc.ops = listener->cc.ops;
+    pcb->rtx.rto_min = listener->rtx.rto_min;
+    tcp_rto_set(pcb);
+    pcb->local = *local;
+    pcb->foreign = *foreign;
+    if (tcp_pcb_buffer_alloc(pcb) == -1) {
         pcb->state = TCP_PCB_STATE_CLOSED;
-        sched_wakeup(&pcb->ctx);
-        return;
+        tcp_pcb_release(pcb);
+        mutex_unlock(&pcb->mutex);
+        memory_free(backlog);
+        return NULL;
     }
-    timeout = entry->last;
-    timeval_add_usec(&timeout, entry->rto);
-    if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
-        entry->last = now;
-        entry->rto *= 2;
+    pcb->rcv.wnd = pcb->rbuf.size;
+    pcb->rcv.wscale = tcp_pcb_wscale(pcb);
+    tcp_options_negotiate(pcb, syn);
+    pcb->irs = syn->seq;
+    pcb->rcv.nxt = syn->seq + 1;
+    pcb->iss = iss;
+    pcb->snd.una = iss + 1;
+    pcb->snd.nxt = iss + 1;
+    pcb->ts.offset = ts_offset;
+    pcb->ts.last_ack_sent = pcb->rcv.nxt;
+    if (sent) {
+        gettimeofday(&now, NULL);
+        timersub(&now, sent, &diff);
+        tcp_rtt_update(pcb, diff.tv_sec * 1000000 + diff.tv_usec);
     }
+    tcp_pcb_set_mss(pcb);
+    tcp_cc_start(&pcb->cc, pcb->mss);
+    pcb->snd.wnd = seg->wnd << pcb->snd.wscale;
+    pcb->snd.wl1 = seg->seq;
+    pcb->snd.wl2 = seg->ack;
+    pcb->state = TCP_PCB_STATE_ESTABLISHED;
+    mutex_lock(&mutex);
+    tcp_hash_insert(TCP_HASH_CONN, pcb);
+    tcp_hash_insert(TCP_HASH_BIND, pcb);
+    mutex_unlock(&mutex);
+    backlog->pcb = pcb;
+    backlog->gen = pcb->gen;
+    if (!queue_push(&listener->backlog, backlog)) {
+        errorf("queue_push() failure");
+        memory_free(backlog);
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        tcp_pcb_release(pcb);
+        mutex_unlock(&pcb->mutex);
+        return NULL;
+    }
+    sched_wakeup(&listener->ctx);
+    return pcb;
 }
 
-static void
-tcp_set_timewait_timer(struct tcp_pcb *pcb)
-{
-    gettimeofday(&pcb->tw_timer, NULL);
-    pcb->tw_timer.tv_sec += TCP_TIMEWAIT_SEC;
-    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
-}
-
-static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+/* NOTE: the ACK to a listener, returns 1 if the connection is established (*pcb is locked), 0 if dropped, -1 if unknown */
+static int
+tcp_synq_ack(struct tcp_pcb *listener, struct tcp_segment_info *seg, struct ip_endpoint *local, struct ip_endpoint *foreign, struct tcp_pcb **pcb)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
-    struct tcp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t psum;
-    uint16_t total;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
+    struct tcp_syn_entry *entry, tmp;
+    char ep[IP_ENDPOINT_STR_LEN];
 
-    hdr = (struct tcp_hdr *)buf;
-    hdr->src = local->port;
-    hdr->dst = foreign->port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->wnd = hton16(wnd);
-    hdr->sum = 0;
-    hdr->up = 0;
-    memcpy(hdr + 1, data, len);
-    pseudo.src = local->addr;
-    pseudo.dst = foreign->addr;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
-    pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    debugf("%s => %s, len=%zu (payload=%zu)",
-        ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
+    mutex_lock(&mutex);
+    entry = tcp_synq_lookup(local, foreign);
+    if (entry && (entry->listener != listener || seg->ack != entry->iss + 1)) {
+        mutex_unlock(&mutex);
         return -1;
     }
-    return len;
-}
-
-static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
-{
-    uint32_t seq;
-
-    seq = pcb->snd.nxt;
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
-        seq = pcb->iss;
+    if (!entry) {
+        if (!tcp_syncookie_recent(listener)) {
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.syn.seq = seg->seq - 1;
+        tmp.syn.mss = tcp_syncookie_check(seg->ack - 1, tmp.syn.seq, local, foreign);
+        mutex_unlock(&mutex);
+        if (!tmp.syn.mss) {
+            return -1;
+        }
+        debugf("valid SYN cookie, foreign=%s, mss=%u", ip_endpoint_ntop(foreign, ep, sizeof(ep)), tmp.syn.mss);
+        tmp.iss = seg->ack - 1;
+        tmp.retries = 1; /* NOTE: no RTT sample */
+    } else {
+        tmp = *entry;
     }
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
-        tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+    if (listener->backlog.num >= listener->backlog_max) {
+        /* NOTE: the peer retransmits (or the SYN-ACK is retransmitted) until the application accepts */
+        debugf("accept queue is full, drop ACK, foreign=%s", ip_endpoint_ntop(foreign, ep, sizeof(ep)));
+        if (entry) {
+            mutex_unlock(&mutex);
+        }
+        return 0;
+    }
+    if (entry) {
+        tcp_synq_free(entry);
+        mutex_unlock(&mutex);
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    *pcb = tcp_synq_establish(listener, &tmp.syn, tmp.iss, tmp.ts_offset, tmp.retries ? NULL : &tmp.sent, seg, local, foreign);
+    return *pcb ? 1 : 0;
 }
 
-/* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
+/* NOTE: the PCB (NULL: not found) must be locked */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    struct tcp_pcb *pcb, *new_pcb;
+    struct tcp_pcb *new_pcb;
+    struct tcp_syn_entry *entry;
     int acceptable = 0;
+    size_t acked, n;
+    uint32_t edge;
+    struct timeval now;
 
-    pcb = tcp_pcb_select(local, foreign);
     if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             return;
         }
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, NULL, 0, 0, local, foreign);
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
         }
         return;
     }
@@ -406,13 +2902,30 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * first check for an RST
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            mutex_lock(&mutex);
+            entry = tcp_synq_lookup(local, foreign);
+            if (entry && entry->listener == pcb && seg->seq == entry->syn.seq + 1) {
+                tcp_synq_free(entry);
+            }
+            mutex_unlock(&mutex);
             return;
         }
         /*
          * second check for an ACK
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            if (pcb->mode == TCP_PCB_MODE_SOCKET && !TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+                switch (tcp_synq_ack(pcb, seg, local, foreign, &new_pcb)) {
+                case 1:
+                    /* NOTE: the rest of the segment (data, FIN) is processed in the ESTABLISHED state */
+                    tcp_segment_arrives(new_pcb, seg, flags, data, len, local, foreign);
+                    mutex_unlock(&new_pcb->mutex);
+                    return;
+                case 0:
+                    return;
+                }
+            }
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
             return;
         }
         /*
@@ -422,22 +2935,24 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* ignore: security/compartment check */
             /* ignore: precedence check */
             if (pcb->mode == TCP_PCB_MODE_SOCKET) {
-                new_pcb = tcp_pcb_alloc();
-                if (!new_pcb) {
-                    errorf("tcp_pcb_alloc() failure");
-                    return;
-                }
-                new_pcb->mode = TCP_PCB_MODE_SOCKET;
-                new_pcb->parent = pcb;
-                pcb = new_pcb;
+                tcp_synq_syn(pcb, seg, local, foreign);
+                return;
             }
+            mutex_lock(&mutex);
+            tcp_hash_remove(TCP_HASH_LISTEN, pcb);
             pcb->local = *local;
             pcb->foreign = *foreign;
-            pcb->rcv.wnd = sizeof(pcb->buf);
+            tcp_hash_insert(TCP_HASH_CONN, pcb);
+            tcp_hash_insert(TCP_HASH_BIND, pcb);
+            mutex_unlock(&mutex);
+            pcb->rcv.wnd = pcb->rbuf.size;
+            pcb->rcv.wscale = tcp_pcb_wscale(pcb);
+            tcp_options_negotiate(pcb, seg);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
             pcb->iss = random();
-            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+            pcb->ts.offset = random();
+            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, 0);
             pcb->snd.nxt = pcb->iss + 1;
             pcb->snd.una = pcb->iss;
             pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
@@ -455,11 +2970,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * first check the ACK bit
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            if (TCP_SEQ_LEQ(seg->ack, pcb->iss) || TCP_SEQ_LT(pcb->snd.nxt, seg->ack)) {
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
                 return;
             }
-            if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+            if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
                 acceptable = 1;
             }
         }
@@ -482,15 +2997,25 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * fourth check the SYN bit
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+            /* NOTE: our SYN offered all of them */
+            tcp_options_negotiate(pcb, seg);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
             if (acceptable) {
                 pcb->snd.una = seg->ack;
-                tcp_retransmit_queue_cleanup(pcb);
+                tcp_retransmit_queue_cleanup(pcb, 0);
             }
-            if (pcb->snd.una > pcb->iss) {
+            if (TCP_SEQ_LT(pcb->iss, pcb->snd.una)) {
+                if (tcp_pcb_buffer_alloc(pcb) == -1) {
+                    tcp_output_segment(pcb->snd.nxt, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+                    pcb->state = TCP_PCB_STATE_CLOSED;
+                    tcp_pcb_release(pcb);
+                    return;
+                }
+                tcp_pcb_set_mss(pcb);
+                tcp_cc_start(&pcb->cc, pcb->mss);
                 pcb->state = TCP_PCB_STATE_ESTABLISHED;
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK, 0);
                 /* NOTE: not specified in the RFC793, but send window initialization required */
                 pcb->snd.wnd = seg->wnd;
                 pcb->snd.wl1 = seg->seq;
@@ -500,7 +3025,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 return;
             } else {
                 pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, 0);
                 /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
                 return;
             }
@@ -514,9 +3039,14 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     /*
      * Otherwise
      */
+    if (!TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+        /* rfc7323 - section 2.3 */
+        seg->wnd <<= pcb->snd.wscale;
+    }
     /*
      * first check sequence number
      */
+    edge = pcb->rcv.nxt + pcb->rcv.wnd; /* NOTE: the right edge of the window, it may wrap */
     switch (pcb->state) {
     case TCP_PCB_STATE_SYN_RECEIVED:
     case TCP_PCB_STATE_ESTABLISHED:
@@ -527,31 +3057,34 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         if (!seg->len) {
-            if (!pcb->rcv.wnd) {
-                if (seg->seq == pcb->rcv.nxt) {
-                    acceptable = 1;
-                }
-            } else {
-                if (pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) {
-                    acceptable = 1;
-                }
+            /*
+             * NOTE: The right edge is also accepted. The ACKs of a peer which filled our window
+             *       carry it while a hole is at rcv.nxt, dropping them would lose the window update.
+             */
+            if (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LEQ(seg->seq, edge)) {
+                acceptable = 1;
             }
         } else {
             if (!pcb->rcv.wnd) {
                 /* not acceptable */
             } else {
-                if ((pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) ||
-                    (pcb->rcv.nxt <= seg->seq + seg->len - 1 && seg->seq + seg->len - 1 < pcb->rcv.nxt + pcb->rcv.wnd)) {
+                if ((TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, edge)) ||
+                    (TCP_SEQ_LEQ(pcb->rcv.nxt, seg->seq + seg->len - 1) && TCP_SEQ_LT(seg->seq + seg->len - 1, edge))) {
                     acceptable = 1;
                 }
             }
         }
+        if (acceptable && !TCP_FLG_ISSET(flags, TCP_FLG_RST) && tcp_options_paws(pcb, seg)) {
+            debugf("old duplicate (PAWS), seq=%u, tsval=%u, recent=%u", seg->seq, seg->tsval, pcb->ts.recent);
+            acceptable = 0;
+        }
         if (!acceptable) {
             if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK, 0);
             }
             return;
         }
+        tcp_options_ts_update(pcb, seg);
         /*
          * In the following it is assumed that the segment is the idealized
          * segment that begins at RCV.NXT and does not exceed the window.
@@ -610,7 +3143,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+            tcp_output(pcb, TCP_FLG_RST, 0);
             errorf("connection reset");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
@@ -626,15 +3159,19 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_SYN_RECEIVED:
-        if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            if (tcp_pcb_buffer_alloc(pcb) == -1) {
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
+                pcb->state = TCP_PCB_STATE_CLOSED;
+                tcp_pcb_release(pcb);
+                return;
+            }
+            tcp_pcb_set_mss(pcb);
+            tcp_cc_start(&pcb->cc, pcb->mss);
             pcb->state = TCP_PCB_STATE_ESTABLISHED;
             sched_wakeup(&pcb->ctx);
-            if (pcb->parent) {
-                queue_push(&pcb->parent->backlog, pcb);
-                sched_wakeup(&pcb->parent->ctx);
-            }
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign);
             return;
         }
         /* fall through */
@@ -643,25 +3180,47 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_FIN_WAIT2:
     case TCP_PCB_STATE_CLOSE_WAIT:
     case TCP_PCB_STATE_CLOSING:
-        if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt) {
+    case TCP_PCB_STATE_LAST_ACK:
+        if ((pcb->flags & TCP_PCB_FLG_SACK) && seg->sack_num) {
+            tcp_sack_update(pcb, seg);
+        }
+        if (TCP_SEQ_LT(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            if (pcb->ts.eifel) {
+                tcp_retransmit_eifel_check(pcb, seg);
+            }
+            /* NOTE: the acknowledged data (not SYN/FIN) leaves the send buffer */
+            acked = MIN(seg->ack - pcb->snd.una, pcb->sbuf.len);
+            if (acked && !(pcb->flags & TCP_PCB_FLG_RECOVERY)) {
+                /* NOTE: the window is not grown during the fast recovery */
+                gettimeofday(&now, NULL);
+                pcb->cc.ops->on_ack(&pcb->cc, acked, pcb->snd.nxt - pcb->snd.una, &now);
+            }
+            tcp_sbuf_consume(pcb, acked);
             pcb->snd.una = seg->ack;
-            tcp_retransmit_queue_cleanup(pcb);
-            /* ignore: Users should receive positive acknowledgments for buffers
-                        which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
-            if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack)) {
+            tcp_retransmit_queue_cleanup(pcb, (pcb->flags & TCP_PCB_FLG_TS) && seg->ts_ok ? seg->tsecr : 0);
+            /* NOTE: wake up the writers waiting for the buffer space */
+            sched_wakeup(&pcb->ctx);
+        } else if (TCP_SEQ_LT(seg->ack, pcb->snd.una)) {
+            /* ignore */
+        } else if (TCP_SEQ_LT(pcb->snd.nxt, seg->ack)) {
+            tcp_output(pcb, TCP_FLG_ACK, 0);
+            return;
+        } else if (seg->ack == pcb->snd.una && !len && seg->wnd == pcb->snd.wnd && pcb->snd.una != pcb->snd.nxt
+            && !TCP_FLG_ISSET(flags, TCP_FLG_SYN | TCP_FLG_FIN)) {
+            /* rfc5681 - section 2 (duplicate acknowledgment) */
+            pcb->rtx.dupacks++;
+        }
+        if (TCP_SEQ_LEQ(pcb->snd.una, seg->ack) && TCP_SEQ_LEQ(seg->ack, pcb->snd.nxt)) {
+            /* NOTE: the window is updated by the duplicate ACK too (e.g. a pure window update) */
+            if (TCP_SEQ_LT(pcb->snd.wl1, seg->seq) || (pcb->snd.wl1 == seg->seq && TCP_SEQ_LEQ(pcb->snd.wl2, seg->ack))) {
                 pcb->snd.wnd = seg->wnd;
                 pcb->snd.wl1 = seg->seq;
                 pcb->snd.wl2 = seg->ack;
             }
-        } else if (seg->ack < pcb->snd.una) {
-            /* ignore */
-        } else if (seg->ack > pcb->snd.nxt) {
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            return;
         }
         switch (pcb->state) {
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if (TCP_FIN_ACKED(pcb, seg->ack)) {
                 pcb->state = TCP_PCB_STATE_FIN_WAIT2;
             }
             break;
@@ -672,21 +3231,26 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* do nothing */
             break;
         case TCP_PCB_STATE_CLOSING:
-            if (seg->ack == pcb->snd.nxt) {
+            if (TCP_FIN_ACKED(pcb, seg->ack)) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
+                tcp_pcb_buffer_free(pcb);
                 /* NOTE: set 2MSL timer, although it is not explicitly stated in the RFC */
                 tcp_set_timewait_timer(pcb);
                 sched_wakeup(&pcb->ctx);
             }
             break;
+        case TCP_PCB_STATE_LAST_ACK:
+            if (TCP_FIN_ACKED(pcb, seg->ack)) {
+                pcb->state = TCP_PCB_STATE_CLOSED;
+                tcp_pcb_release(pcb);
+                return;
+            }
+            break;
         }
+        /* NOTE: the acknowledgment or the window update may allow further transmission */
+        tcp_retransmit_recover(pcb);
+        tcp_transmit(pcb);
         break;
-    case TCP_PCB_STATE_LAST_ACK:
-        if (seg->ack == pcb->snd.nxt) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            tcp_pcb_release(pcb);
-        }
-        return;
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_FIN)) {
             tcp_set_timewait_timer(pcb); /* restart time-wait timer */
@@ -703,12 +3267,21 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
-        if (len) {
-            memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
-            pcb->rcv.nxt = seg->seq + seg->len;
-            pcb->rcv.wnd -= len;
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            sched_wakeup(&pcb->ctx);
+        if (len && !pcb->rbuf.data) {
+            /* NOTE: closed before established, no one reads the text */
+            pcb->rcv.nxt = seg->seq + len;
+            tcp_output(pcb, TCP_FLG_ACK, 0);
+        } else if (len) {
+            n = tcp_reassemble(pcb, seg->seq, data, len);
+            if (n && tcp_rbuf_readable(pcb) >= tcp_rbuf_lowat(pcb, SIZE_MAX)) {
+                /* NOTE: the reader is not woken up for less than the low-water mark */
+                sched_wakeup(&pcb->ctx);
+            }
+            /*
+             * NOTE: An out-of-order segment is answered with a duplicate ACK at once, and so
+             *       is the one filling a hole (rfc5681 - section 4.2), the others may wait.
+             */
+            tcp_delack(pcb, n, n != len || pcb->ooo || (TCP_FLG_ISSET(flags, TCP_FLG_PSH) && (pcb->flags & TCP_PCB_FLG_PUSHACK)));
         }
         break;
     case TCP_PCB_STATE_CLOSE_WAIT:
@@ -730,8 +3303,12 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* drop segment */
             return;
         }
-        pcb->rcv.nxt = seg->seq + 1;
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        if (seg->seq + seg->len - 1 != pcb->rcv.nxt && seg->seq + seg->len != pcb->rcv.nxt) {
+            /* NOTE: FIN beyond the received data, it will be retransmitted */
+            return;
+        }
+        pcb->rcv.nxt = seg->seq + seg->len;
+        tcp_output(pcb, TCP_FLG_ACK, 0);
         switch (pcb->state) {
         case TCP_PCB_STATE_SYN_RECEIVED:
         case TCP_PCB_STATE_ESTABLISHED:
@@ -739,8 +3316,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             sched_wakeup(&pcb->ctx);
             break;
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if (TCP_FIN_ACKED(pcb, seg->ack)) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
+                tcp_pcb_buffer_free(pcb);
                 tcp_set_timewait_timer(pcb);
             } else {
                 pcb->state = TCP_PCB_STATE_CLOSING;
@@ -748,6 +3326,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             break;
         case TCP_PCB_STATE_FIN_WAIT2:
             pcb->state = TCP_PCB_STATE_TIME_WAIT;
+            tcp_pcb_buffer_free(pcb);
             tcp_set_timewait_timer(pcb);
             break;
         case TCP_PCB_STATE_CLOSE_WAIT:
@@ -768,8 +3347,12 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     return;
 }
 
-static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+/*
+ * NOTE: if early is set, the segment is processed only if it belongs to an established connection,
+ *       flow is the connection found by the early lookup (NULL: look it up)
+ */
+static int
+tcp_input_core(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, int early, const struct ip_early_flow *flow)
 {
     struct tcp_hdr *hdr;
     struct pseudo_hdr pseudo;
@@ -778,10 +3361,11 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     char addr2[IP_ADDR_STR_LEN];
     struct ip_endpoint local, foreign;
     struct tcp_segment_info seg;
+    struct tcp_pcb *pcb;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
-        return;
+        return 0;
     }
     hdr = (struct tcp_hdr *)data;
     pseudo.src = src;
@@ -792,12 +3376,7 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
     if (cksum16((uint16_t *)hdr, len, psum) != 0) {
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
-    }
-    if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
-        errorf("only supports unicast, src=%s, dst=%s",
-            ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
-        return;
+        return 0;
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
@@ -809,6 +3388,12 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("invalid header length, hlen=%u", hlen);
+        return 0;
+    }
+    memset(&seg, 0, sizeof(seg));
+    tcp_options_parse((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg);
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen;
@@ -820,24 +3405,106 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
+    pcb = flow ? tcp_pcb_get_early(flow) : tcp_pcb_lookup(&local, &foreign, early);
+    if (early && !pcb) {
+        return -1;
+    }
+    tcp_segment_arrives(pcb, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    if (pcb) {
+        mutex_unlock(&pcb->mutex);
+    }
+    tcp_output_flush();
+    return 0;
+}
+
+static void
+tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
+        errorf("only supports unicast, src=%s, dst=%s",
+            ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
+        return;
+    }
+    tcp_input_core(data, len, src, dst, 0, NULL);
+}
+
+/*
+ * TCP Early Demux
+ *
+ * NOTE: The segments of the connections (the PCBs in the connection hash)
+ *       are delivered directly from the device poll (see ip_early_demux()).
+ */
+
+static int
+tcp_early_lookup(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_early_flow *flow)
+{
+    struct tcp_hdr *hdr;
+    struct ip_endpoint local, foreign;
+    struct tcp_pcb *pcb;
+
+    if (len < sizeof(*hdr)) {
+        return -1;
+    }
+    hdr = (struct tcp_hdr *)data;
+    local.addr = dst;
+    local.port = hdr->dst;
+    foreign.addr = src;
+    foreign.port = hdr->src;
     mutex_lock(&mutex);
-    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    pcb = tcp_hash_lookup_conn(&local, &foreign);
+    if (!pcb) {
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    /* NOTE: the generation tells whether it is released until the input */
+    flow->id = pcb->id;
+    flow->gen = pcb->gen;
     mutex_unlock(&mutex);
-    return;
+    return 0;
+}
+
+static int
+tcp_early_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, const struct ip_early_flow *flow)
+{
+    return tcp_input_core(data, len, src, dst, 1, flow);
+}
+
+/* NOTE: the PCBs due are collected first, they are locked after unlocking the wheel (lock order) */
+static void
+tcp_timer_collect(struct tcp_timer_link *link, void *arg)
+{
+    struct tcp_pcb **batch, *pcb;
+
+    batch = arg;
+    pcb = (struct tcp_pcb *)((uint8_t *)link - offsetof(struct tcp_pcb, timer));
+    pcb->timer_batch = *batch;
+    *batch = pcb;
 }
 
 static void
 tcp_timer(void)
 {
-    struct tcp_pcb *pcb;
+    struct tcp_pcb *pcb, *batch = NULL;
     struct timeval now;
+    uint8_t opt[TCP_OPTION_SPACE_MAX];
+    size_t optlen;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
     gettimeofday(&now, NULL);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    mutex_lock(&timer_mutex);
+    tcp_timer_wheel_expire(&pcb_timers, &now, tcp_timer_collect, &batch);
+    mutex_unlock(&timer_mutex);
+    while (batch) {
+        pcb = batch;
+        batch = pcb->timer_batch;
+        /* NOTE: it may have been released (or reused) meanwhile, the timers tell what is due */
+        mutex_lock(&pcb->mutex);
         if (pcb->state == TCP_PCB_STATE_FREE) {
+            mutex_unlock(&pcb->mutex);
             continue;
         }
         if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
@@ -845,37 +3512,82 @@ tcp_timer(void)
                 debugf("timewait has elapsed, local=%s, foreign=%s",
                     ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
                 tcp_pcb_release(pcb);
+                mutex_unlock(&pcb->mutex);
                 continue;
             }
         }
-        queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+        tcp_retransmit_timeout(pcb, &now);
+        if (timerisset(&pcb->delack.expire) && timercmp(&now, &pcb->delack.expire, >)) {
+            tcp_output(pcb, TCP_FLG_ACK, 0);
+        }
+        if (timerisset(&pcb->persist.expire) && timercmp(&now, &pcb->persist.expire, >)) {
+            /* NOTE: an out of window segment elicits an ACK with the current window */
+            optlen = tcp_options_build(pcb, TCP_FLG_ACK, 0, opt);
+            tcp_output_segment(pcb->snd.una - 1, pcb->rcv.nxt, TCP_FLG_ACK, tcp_pcb_window(pcb, TCP_FLG_ACK), opt, optlen, NULL, 0, 0, &pcb->local, &pcb->foreign);
+            pcb->persist.timeout = MIN(pcb->persist.timeout * 2, TCP_PERSIST_TIMEOUT_MAX);
+            pcb->persist.expire = now;
+            timeval_add_usec(&pcb->persist.expire, pcb->persist.timeout);
+        }
+        if (pcb->state != TCP_PCB_STATE_FREE) {
+            tcp_pcb_timer_update(pcb);
+        }
+        mutex_unlock(&pcb->mutex);
     }
+    mutex_lock(&mutex);
+    tcp_synq_timer(&now);
     mutex_unlock(&mutex);
+    tcp_output_flush();
 }
 
 static void
 event_handler(void *arg)
 {
     struct tcp_pcb *pcb;
+    unsigned int num, i;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    num = __atomic_load_n(&chunk_num, __ATOMIC_ACQUIRE) * TCP_PCB_CHUNK_SIZE;
+    for (i = 0; i < num; i++) {
+        pcb = tcp_pcb_entry(i);
+        mutex_lock(&pcb->mutex);
         if (pcb->state != TCP_PCB_STATE_FREE) {
             sched_interrupt(&pcb->ctx);
         }
+        mutex_unlock(&pcb->mutex);
     }
-    mutex_unlock(&mutex);
 }
 
 int
 tcp_init(void)
 {
-    struct timeval interval = {0,100000};
+    struct timeval interval = {0,TCP_TIMER_INTERVAL};
+    int type, i;
 
+    if (tcp_cc_init() == -1) {
+        errorf("tcp_cc_init() failure");
+        return -1;
+    }
+    if (!tcp_cc_lookup(TCP_CC_DEFAULT)) {
+        errorf("unknown congestion control, name=%s", TCP_CC_DEFAULT);
+        return -1;
+    }
+    for (type = 0; type < TCP_HASH_NUM; type++) {
+        if (tcp_hash_grow(type) == -1) {
+            errorf("tcp_hash_grow() failure");
+            return -1;
+        }
+    }
+    for (i = TCP_SYNQ_SIZE - 1; i >= 0; i--) {
+        synq[i].next = synq_freelist;
+        synq_freelist = &synq[i];
+    }
     if (ip_protocol_register("TCP", IP_PROTOCOL_TCP, tcp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
     }
+    if (ip_protocol_register_early_demux(IP_PROTOCOL_TCP, tcp_early_lookup, tcp_early_input) == -1) {
+        errorf("ip_protocol_register_early_demux() failure");
+        return -1;
+    }
     if (net_timer_register("TCP Timer", interval, tcp_timer) == -1) {
         errorf("net_timer_register() failure");
         return -1;
@@ -896,11 +3608,9 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
     char ep2[IP_ENDPOINT_STR_LEN];
     int state, id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_alloc();
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_RFC793;
@@ -911,18 +3621,28 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
             pcb->foreign = *foreign;
         }
         pcb->state = TCP_PCB_STATE_LISTEN;
+        mutex_lock(&mutex);
+        tcp_hash_insert(TCP_HASH_LISTEN, pcb);
+        tcp_hash_insert(TCP_HASH_BIND, pcb);
+        mutex_unlock(&mutex);
     } else {
         debugf("active open: local=%s, foreign=%s, connecting...",
             ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+        mutex_lock(&mutex);
         pcb->local = *local;
         pcb->foreign = *foreign;
-        pcb->rcv.wnd = sizeof(pcb->buf);
+        tcp_hash_insert(TCP_HASH_CONN, pcb);
+        tcp_hash_insert(TCP_HASH_BIND, pcb);
+        mutex_unlock(&mutex);
+        pcb->rcv.wnd = pcb->rbuf.size;
+        pcb->rcv.wscale = tcp_pcb_wscale(pcb);
         pcb->iss = random();
-        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+        pcb->ts.offset = random();
+        if (tcp_output(pcb, TCP_FLG_SYN, 0) == -1) {
             errorf("tcp_output() failure");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             return -1;
         }
         pcb->snd.una = pcb->iss;
@@ -933,11 +3653,11 @@ AGAIN:
     state = pcb->state;
     /* waiting for state changed */
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (tcp_pcb_sleep(pcb, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             errno = EINTR;
             return -1;
         }
@@ -949,13 +3669,13 @@ AGAIN:
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     id = tcp_pcb_id(pcb);
     debugf("connection established: local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return id;
 }
 
@@ -965,20 +3685,18 @@ tcp_state(int id)
     struct tcp_pcb *pcb;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_RFC793) {
         errorf("not opened in rfc793 mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     state = pcb->state;
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return state;
 }
 
@@ -992,17 +3710,36 @@ tcp_open(void)
     struct tcp_pcb *pcb;
     int id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_alloc();
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
-    pcb->mode = TCP_PCB_MODE_SOCKET;
-    id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
-    return id;
+    pcb->mode = TCP_PCB_MODE_SOCKET;
+    id = tcp_pcb_id(pcb);
+    tcp_pcb_unlock(pcb);
+    return id;
+}
+
+/* NOTE: an unbound socket takes the source address of the path selected by the flow hash (multipath) */
+static int
+tcp_select_source(struct ip_endpoint *local, ip_addr_t bound, struct ip_endpoint *foreign)
+{
+    struct ip_iface *iface;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (bound != IP_ADDR_ANY) {
+        local->addr = bound;
+        return 0;
+    }
+    iface = ip_route_get_iface_flow(IP_PROTOCOL_TCP, foreign->addr, local->port, foreign->port);
+    if (!iface) {
+        errorf("ip_route_get_iface_flow() failure, addr=%s", ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+        return -1;
+    }
+    local->addr = iface->unicast;
+    debugf("select source address: %s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
+    return 0;
 }
 
 int
@@ -1010,61 +3747,70 @@ tcp_connect(int id, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb;
     struct ip_endpoint local;
-    struct ip_iface *iface;
-    char addr[IP_ADDR_STR_LEN];
-    int p;
+    int i, p;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     local.addr = pcb->local.addr;
     local.port = pcb->local.port;
-    if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("ip_route_get_iface() failure");
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        debugf("select source address: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
-        local.addr = iface->unicast;
-    }
+    mutex_lock(&mutex);
     if (!local.port) {
-        for (p = TCP_SOURCE_PORT_MIN; p <= TCP_SOURCE_PORT_MAX; p++) {
-            local.port = p;
+        /* NOTE: a port is reusable as long as the 4-tuple is unique and no one binds it without the foreign endpoint, start from the port next to the last one */
+        for (i = 0; i < TCP_SOURCE_PORT_RANGE; i++) {
+            p = TCP_SOURCE_PORT_MIN + (port_offset + i) % TCP_SOURCE_PORT_RANGE;
+            local.port = hton16(p);
+            if (tcp_select_source(&local, pcb->local.addr, foreign) == -1) {
+                errorf("tcp_select_source() failure");
+                mutex_unlock(&mutex);
+                tcp_pcb_unlock(pcb);
+                return -1;
+            }
+            if (tcp_hash_lookup_bind_unconnected(&local)) {
+                continue;
+            }
             if (!tcp_pcb_select(&local, foreign)) {
-                debugf("dinamic assign srouce port: %d", ntoh16(local.port));
-                pcb->local.port = local.port;
+                debugf("dinamic assign srouce port: %d", p);
+                port_offset = (port_offset + i + 1) % TCP_SOURCE_PORT_RANGE;
                 break;
             }
         }
-        if (!local.port) {
+        if (i == TCP_SOURCE_PORT_RANGE) {
             debugf("failed to dinamic assign srouce port");
             mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             return -1;
         }
+    } else if (tcp_select_source(&local, pcb->local.addr, foreign) == -1) {
+        errorf("tcp_select_source() failure");
+        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
+        return -1;
     }
     pcb->local.addr = local.addr;
     pcb->local.port = local.port;
     pcb->foreign.addr = foreign->addr;
     pcb->foreign.port = foreign->port;
-    pcb->rcv.wnd = sizeof(pcb->buf);
+    tcp_hash_insert(TCP_HASH_CONN, pcb);
+    tcp_hash_insert(TCP_HASH_BIND, pcb);
+    mutex_unlock(&mutex);
+    pcb->rcv.wnd = pcb->rbuf.size;
+    pcb->rcv.wscale = tcp_pcb_wscale(pcb);
     pcb->iss = random();
-    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+    pcb->ts.offset = random();
+    if (tcp_output(pcb, TCP_FLG_SYN, 0) == -1) {
         errorf("tcp_output() failure");
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     pcb->snd.una = pcb->iss;
@@ -1074,11 +3820,11 @@ AGAIN:
     state = pcb->state;
     // waiting for state changed
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (tcp_pcb_sleep(pcb, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             errno = EINTR;
             return -1;
         }
@@ -1090,11 +3836,11 @@ AGAIN:
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return id;
 }
 
@@ -1104,27 +3850,30 @@ tcp_bind(int id, struct ip_endpoint *local)
     struct tcp_pcb *pcb, *exist;
     char ep[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
+    mutex_lock(&mutex);
     exist = tcp_pcb_select(local, NULL);
     if (exist) {
         errorf("already bound, exist=%s", ip_endpoint_ntop(&exist->local, ep, sizeof(ep)));
         mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
+    tcp_hash_remove(TCP_HASH_BIND, pcb);
     pcb->local = *local;
-    debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
+    tcp_hash_insert(TCP_HASH_BIND, pcb);
     mutex_unlock(&mutex);
+    debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
+    tcp_pcb_unlock(pcb);
     return 0;
 }
 
@@ -1133,21 +3882,23 @@ tcp_listen(int id, int backlog)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     pcb->state = TCP_PCB_STATE_LISTEN;
-    (void)backlog; // TODO: set backlog
+    mutex_lock(&mutex);
+    tcp_hash_insert(TCP_HASH_LISTEN, pcb);
     mutex_unlock(&mutex);
+    /* NOTE: a connection can be queued at least (same as Linux) */
+    pcb->backlog_max = MIN(MAX(backlog, 1), TCP_BACKLOG_MAX);
+    tcp_pcb_unlock(pcb);
     return 0;
 }
 
@@ -1155,36 +3906,44 @@ int
 tcp_accept(int id, struct ip_endpoint *foreign)
 {
     struct tcp_pcb *pcb, *new_pcb;
+    struct tcp_backlog_entry *backlog;
     int new_id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     if (pcb->state != TCP_PCB_STATE_LISTEN) {
         errorf("not in LISTEN state");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    while (!(new_pcb = queue_pop(&pcb->backlog))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (1) {
+        backlog = queue_pop(&pcb->backlog);
+        if (backlog) {
+            new_pcb = tcp_backlog_child(pcb, backlog);
+            if (new_pcb) {
+                break;
+            }
+            /* NOTE: released before accepted (e.g. reset by the peer) */
+            continue;
+        }
+        if (tcp_pcb_sleep(pcb, NULL) == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             errno = EINTR;
             return -1;
         }
         if (pcb->state == TCP_PCB_STATE_CLOSED) {
             debugf("closed");
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            tcp_pcb_unlock(pcb);
             return -1;
         }
     }
@@ -1192,62 +3951,265 @@ tcp_accept(int id, struct ip_endpoint *foreign)
         *foreign = new_pcb->foreign;
     }
     new_id = tcp_pcb_id(new_pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&new_pcb->mutex);
+    tcp_pcb_unlock(pcb);
     return new_id;
 }
 
+/* NOTE: the PCB flag of a boolean option */
+static uint16_t
+tcp_opt_flag(int opt)
+{
+    switch (opt) {
+    case TCP_OPT_NODELAY:
+        return TCP_PCB_FLG_NODELAY;
+    case TCP_OPT_CORK:
+        return TCP_PCB_FLG_CORK;
+    case TCP_OPT_QUICKACK:
+        return TCP_PCB_FLG_QUICKACK;
+    case TCP_OPT_PUSHACK:
+        return TCP_PCB_FLG_PUSHACK;
+    }
+    return 0;
+}
+
+int
+tcp_setopt(int id, int opt, const void *val, size_t len)
+{
+    struct tcp_pcb *pcb;
+    uint16_t flag;
+    char name[TCP_CC_NAME_LEN];
+    struct tcp_cc_ops *ops;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    switch (opt) {
+    case TCP_OPT_RCVBUF:
+        if (len != sizeof(int) || *(int *)val < TCP_RCVBUF_SIZE_MIN || *(int *)val > TCP_RCVBUF_SIZE_MAX) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        if (pcb->state != TCP_PCB_STATE_CLOSED && pcb->state != TCP_PCB_STATE_LISTEN) {
+            errorf("must be set before the connection is opened, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        pcb->rbuf.size = *(int *)val;
+        break;
+    case TCP_OPT_SNDBUF:
+        if (len != sizeof(int) || *(int *)val < TCP_SNDBUF_SIZE_MIN || *(int *)val > TCP_SNDBUF_SIZE_MAX) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        if (pcb->state != TCP_PCB_STATE_CLOSED && pcb->state != TCP_PCB_STATE_LISTEN) {
+            errorf("must be set before the connection is opened, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        pcb->sbuf.size = *(int *)val;
+        break;
+    case TCP_OPT_RCVLOWAT:
+        if (len != sizeof(int) || *(int *)val < 0) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        pcb->rbuf.lowat = *(int *)val;
+        /* NOTE: the reader may be satisfied by the data already received */
+        sched_wakeup(&pcb->ctx);
+        break;
+    case TCP_OPT_NODELAY:
+    case TCP_OPT_CORK:
+    case TCP_OPT_QUICKACK:
+    case TCP_OPT_PUSHACK:
+        if (len != sizeof(int)) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        flag = tcp_opt_flag(opt);
+        if (*(int *)val) {
+            pcb->flags |= flag;
+        } else {
+            pcb->flags &= ~flag;
+        }
+        if (pcb->sbuf.data) {
+            /* NOTE: push the data held so far */
+            tcp_transmit(pcb);
+        }
+        if ((pcb->flags & TCP_PCB_FLG_QUICKACK) && timerisset(&pcb->delack.expire)) {
+            tcp_output(pcb, TCP_FLG_ACK, 0);
+        }
+        break;
+    case TCP_OPT_RTO_MIN:
+        if (len != sizeof(int) || *(int *)val < TCP_TIMER_INTERVAL || *(int *)val > TCP_RTO_MAX) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        pcb->rtx.rto_min = *(int *)val;
+        tcp_rto_set(pcb);
+        break;
+    case TCP_OPT_CONGESTION:
+        if (!len || len >= sizeof(name)) {
+            errorf("invalid value, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        memcpy(name, val, len);
+        name[len] = '\0';
+        ops = tcp_cc_lookup(name);
+        if (!ops) {
+            errorf("unknown congestion control, name=%s", name);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        if (ops != pcb->cc.ops) {
+            pcb->cc.ops = ops;
+            if (pcb->cc.mss) {
+                /* NOTE: switched in the middle of the connection, the windows are inherited */
+                memset(pcb->cc.priv, 0, sizeof(pcb->cc.priv));
+                if (ops->init) {
+                    ops->init(&pcb->cc);
+                }
+            }
+        }
+        break;
+    default:
+        errorf("unknown option, opt=%d", opt);
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
+int
+tcp_getopt(int id, int opt, void *val, size_t *len)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    switch (opt) {
+    case TCP_OPT_RCVBUF:
+        if (*len < sizeof(int)) {
+            errorf("too short, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        *(int *)val = pcb->rbuf.size;
+        *len = sizeof(int);
+        break;
+    case TCP_OPT_SNDBUF:
+    case TCP_OPT_RCVLOWAT:
+    case TCP_OPT_NODELAY:
+    case TCP_OPT_CORK:
+    case TCP_OPT_QUICKACK:
+    case TCP_OPT_PUSHACK:
+    case TCP_OPT_RTO_MIN:
+        if (*len < sizeof(int)) {
+            errorf("too short, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        if (opt == TCP_OPT_SNDBUF) {
+            *(int *)val = pcb->sbuf.size;
+        } else if (opt == TCP_OPT_RCVLOWAT) {
+            *(int *)val = pcb->rbuf.lowat;
+        } else if (opt == TCP_OPT_RTO_MIN) {
+            *(int *)val = pcb->rtx.rto_min;
+        } else {
+            *(int *)val = (pcb->flags & tcp_opt_flag(opt)) ? 1 : 0;
+        }
+        *len = sizeof(int);
+        break;
+    case TCP_OPT_CONGESTION:
+        if (*len < strlen(pcb->cc.ops->name) + 1) {
+            errorf("too short, opt=%d", opt);
+            tcp_pcb_unlock(pcb);
+            return -1;
+        }
+        strcpy(val, pcb->cc.ops->name);
+        *len = strlen(pcb->cc.ops->name) + 1;
+        break;
+    default:
+        errorf("unknown option, opt=%d", opt);
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
 /*
  * TCP User Command (Common)
  */
 
+/* NOTE: it returns as soon as the data is buffered, the transmission is driven by ACKs (see tcp_transmit()) */
 ssize_t
-tcp_send(int id, uint8_t *data, size_t len)
+tcp_sendmsg(int id, uint8_t *data, size_t len, int flags)
 {
     struct tcp_pcb *pcb;
-    ssize_t sent = 0;
-    struct ip_iface *iface;
-    size_t mss, cap, slen;
+    ssize_t sent = 0, n;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         // ignore: change the connection from passive to active
         errorf("this connection is passive");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         // ignore: Queue the data for transmission after entering ESTABLISHED state
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
-        if (!iface) {
-            errorf("iface not found");
-            mutex_unlock(&mutex);
-            return -1;
+        if (flags & TCP_MSG_MORE) {
+            pcb->flags |= TCP_PCB_FLG_MORE;
+        } else {
+            pcb->flags &= ~TCP_PCB_FLG_MORE;
         }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
         while (sent < (ssize_t)len) {
-            cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
-            if (!cap) {
-                if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            if (flags & TCP_MSG_ZEROCOPY) {
+                n = tcp_sbuf_reference(pcb, data + sent, len - sent);
+                if (n == -1) {
+                    if (!sent) {
+                        tcp_pcb_unlock(pcb);
+                        return -1;
+                    }
+                    break;
+                }
+            } else {
+                n = tcp_sbuf_write(pcb, data + sent, len - sent);
+            }
+            if (!n) {
+                /* the buffer is full, wait for the acknowledgment */
+                tcp_transmit(pcb);
+                if (tcp_pcb_sleep(pcb, NULL) == -1) {
                     debugf("interrupted");
                     if (!sent) {
-                        mutex_unlock(&mutex);
+                        tcp_pcb_unlock(pcb);
                         errno = EINTR;
                         return -1;
                     }
@@ -1255,17 +4217,12 @@ RETRY:
                 }
                 goto RETRY;
             }
-            slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
-                errorf("tcp_output() failure");
-                pcb->state = TCP_PCB_STATE_CLOSED;
-                tcp_pcb_release(pcb);
-                mutex_unlock(&mutex);
-                return -1;
-            }
-            pcb->snd.nxt += slen;
-            sent += slen;
+            sent += n;
+        }
+        if ((flags & TCP_MSG_ZEROCOPY) && sent) {
+            tcp_sbuf_notify(pcb);
         }
+        tcp_transmit(pcb);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
@@ -1273,99 +4230,245 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return sent;
 }
 
-ssize_t
-tcp_receive(int id, uint8_t *buf, size_t size)
+/*
+ * NOTE: The zero-copy sends (TCP_MSG_ZEROCOPY) are numbered from 0 in the order
+ *       they return, the buffers of [*lo, *hi] may be reused. It returns 0 if
+ *       none has been completed since the last call (the releases are in order).
+ * NOTE: The sends pending when the connection is torn down are reported as
+ *       completed as well, the data may not have been delivered.
+ */
+int
+tcp_zerocopy_completed(int id, uint32_t *lo, uint32_t *hi)
 {
     struct tcp_pcb *pcb;
-    size_t remain, len;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
+    if (pcb->zc.reported == pcb->zc.done) {
+        tcp_pcb_unlock(pcb);
+        return 0;
+    }
+    *lo = pcb->zc.reported;
+    *hi = pcb->zc.done - 1;
+    pcb->zc.reported = pcb->zc.done;
+    tcp_pcb_unlock(pcb);
+    return 1;
+}
+
+ssize_t
+tcp_send(int id, uint8_t *data, size_t len)
+{
+    return tcp_sendmsg(id, data, len, 0);
+}
+
+/*
+ * NOTE: Wait for the data to read (not borrowed yet) up to the low-water mark
+ *       for a reader of size bytes, it returns the length available, 0 if the
+ *       connection is closing or -1 on error.
+ */
+static ssize_t
+tcp_receive_wait(struct tcp_pcb *pcb, size_t size)
+{
+    size_t remain;
+
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
         return -1;
     case TCP_PCB_STATE_LISTEN:
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         /* ignore: Queue for processing after entering ESTABLISHED state */
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
-        if (!remain) {
-            if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        remain = tcp_rbuf_readable(pcb);
+        if (!remain || remain < tcp_rbuf_lowat(pcb, size)) {
+            if (tcp_pcb_sleep(pcb, NULL) == -1) {
                 debugf("interrupted");
-                mutex_unlock(&mutex);
                 errno = EINTR;
                 return -1;
             }
             goto RETRY;
         }
-        break;
+        return remain;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        /* NOTE: no more data will come, the rest is returned regardless of the low-water mark */
+        remain = tcp_rbuf_readable(pcb);
         if (remain) {
-            break;
+            return remain;
         }
         /* fall through */
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         debugf("connection closing");
-        mutex_unlock(&mutex);
         return 0;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
         return -1;
     }
-    len = MIN(size, remain);
-    memcpy(buf, pcb->buf, len);
-    memmove(pcb->buf, pcb->buf + len, remain - len);
-    pcb->rcv.wnd += len;
-    mutex_unlock(&mutex);
+}
+
+/* NOTE: called when the data is consumed by the user */
+static void
+tcp_receive_window_update(struct tcp_pcb *pcb)
+{
+    size_t threshold;
+
+    /* NOTE: window update if it has opened enough (receiver side SWS avoidance, RFC 1122 4.2.3.3) */
+    threshold = pcb->rbuf.size / 2;
+    if (pcb->mss) {
+        threshold = MIN(threshold, pcb->mss);
+    }
+    if (pcb->rcv.wnd > pcb->rcv.adv && (size_t)(pcb->rcv.wnd - pcb->rcv.adv) >= threshold) {
+        tcp_output(pcb, TCP_FLG_ACK, 0);
+    } else if (timerisset(&pcb->delack.expire) && pcb->rcv.wnd == pcb->rbuf.size) {
+        /* NOTE: all read, the peer may be waiting for the ACK to send more (e.g. Nagle's algorithm) */
+        tcp_output(pcb, TCP_FLG_ACK, 0);
+    }
+}
+
+ssize_t
+tcp_receive(int id, uint8_t *buf, size_t size)
+{
+    struct tcp_pcb *pcb;
+    ssize_t remain;
+    size_t len, off;
+    struct iovec iov[2];
+    int iovcnt, i;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (pcb->rbuf.lent) {
+        errorf("data is borrowed, release it first");
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    remain = tcp_receive_wait(pcb, size);
+    if (remain <= 0) {
+        tcp_pcb_unlock(pcb);
+        return remain;
+    }
+    len = MIN(size, (size_t)remain);
+    iovcnt = tcp_rbuf_peek(pcb, iov, 0, len);
+    for (i = 0, off = 0; i < iovcnt; off += iov[i].iov_len, i++) {
+        memcpy(buf + off, iov[i].iov_base, iov[i].iov_len);
+    }
+    tcp_rbuf_consume(pcb, len);
+    tcp_receive_window_update(pcb);
+    tcp_pcb_unlock(pcb);
+    return len;
+}
+
+/*
+ * NOTE: Lend the received data in place (no copy) as up to *iovcnt read-only
+ *       views, following the data borrowed so far. The data stays in the receive
+ *       buffer and keeps the window closed until tcp_receive_release() is called,
+ *       the views are valid until then (or until the id is reused).
+ */
+ssize_t
+tcp_receive_borrow(int id, struct iovec *iov, int *iovcnt)
+{
+    struct tcp_pcb *pcb;
+    ssize_t remain;
+    struct iovec tmp[2];
+    size_t len = 0;
+    int num, i;
+
+    if (*iovcnt < 1) {
+        errorf("no view to fill");
+        return -1;
+    }
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    remain = tcp_receive_wait(pcb, SIZE_MAX);
+    if (remain <= 0) {
+        tcp_pcb_unlock(pcb);
+        *iovcnt = 0;
+        return remain;
+    }
+    num = tcp_rbuf_peek(pcb, tmp, pcb->rbuf.lent, remain);
+    num = MIN(num, *iovcnt);
+    for (i = 0; i < num; i++) {
+        iov[i] = tmp[i];
+        len += tmp[i].iov_len;
+    }
+    pcb->rbuf.lent += len;
+    tcp_pcb_unlock(pcb);
+    *iovcnt = num;
     return len;
 }
 
+/* NOTE: give back len bytes of the borrowed data (from the oldest), the window opens for them */
+int
+tcp_receive_release(int id, size_t len)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (len > pcb->rbuf.lent) {
+        errorf("not borrowed, len=%zu, lent=%u", len, pcb->rbuf.lent);
+        tcp_pcb_unlock(pcb);
+        return -1;
+    }
+    pcb->rbuf.lent -= len;
+    if (!pcb->rbuf.data) {
+        /* NOTE: the buffer was freed (the connection is closing) while lent */
+        if (!pcb->rbuf.lent) {
+            memory_free(pcb->kept);
+            pcb->kept = NULL;
+        }
+        tcp_pcb_unlock(pcb);
+        return 0;
+    }
+    tcp_rbuf_consume(pcb, len);
+    tcp_receive_window_update(pcb);
+    tcp_pcb_unlock(pcb);
+    return 0;
+}
+
 int
 tcp_close(int id)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
-        errorf("connection does not exist");
-        mutex_unlock(&mutex);
-        return -1;
+        /* NOTE: aborted (e.g. the retransmission timed out), the PCB is still held for the user */
+        break;
     case TCP_PCB_STATE_LISTEN:
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
@@ -1373,34 +4476,33 @@ tcp_close(int id)
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
     case TCP_PCB_STATE_SYN_RECEIVED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
-        pcb->state = TCP_PCB_STATE_FIN_WAIT1;
-        break;
     case TCP_PCB_STATE_ESTABLISHED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0);
-        pcb->snd.nxt++;
+        /* NOTE: FIN follows the buffered data, which is pushed regardless of the cork */
+        pcb->flags &= ~(TCP_PCB_FLG_CORK | TCP_PCB_FLG_MORE);
+        pcb->flags |= TCP_PCB_FLG_FIN;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+        tcp_transmit(pcb);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
+        pcb->flags &= ~(TCP_PCB_FLG_CORK | TCP_PCB_FLG_MORE);
+        pcb->flags |= TCP_PCB_FLG_FIN;
         pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
+        tcp_transmit(pcb);
         break;
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        tcp_pcb_unlock(pcb);
         return -1;
     }
     if (pcb->state == TCP_PCB_STATE_CLOSED) {
@@ -1408,6 +4510,6 @@ tcp_close(int id)
     } else {
         sched_wakeup(&pcb->ctx);
     }
-    mutex_unlock(&mutex);
+    tcp_pcb_unlock(pcb);
     return 0;
 }
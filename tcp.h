@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "ip.h"
 
@@ -18,6 +19,19 @@
 #define TCP_STATE_CLOSE_WAIT  10
 #define TCP_STATE_LAST_ACK    11
 
+#define TCP_OPT_RCVBUF  1 /* int: size of the receive buffer (must be set before the connection is opened) */
+#define TCP_OPT_SNDBUF  2 /* int: size of the send buffer (must be set before the connection is opened) */
+#define TCP_OPT_NODELAY 3 /* int: send partial segments without waiting for the ACK (disable Nagle's algorithm) */
+#define TCP_OPT_CORK    4 /* int: hold partial segments until it is cleared */
+#define TCP_OPT_CONGESTION 5 /* string: name of the congestion control algorithm (e.g. "newreno", "cubic") */
+#define TCP_OPT_RTO_MIN 6 /* int: lower bound of the retransmission timeout in micro seconds */
+#define TCP_OPT_QUICKACK 7 /* int: acknowledge every segment at once (disable the delayed ACK) */
+#define TCP_OPT_PUSHACK  8 /* int: acknowledge a segment with PSH at once */
+#define TCP_OPT_RCVLOWAT 9 /* int: bytes to wake up the reader (like SO_RCVLOWAT, 0 or 1: any) */
+
+#define TCP_MSG_MORE 0x01 /* more data follows, hold a partial segment (like MSG_MORE) */
+#define TCP_MSG_ZEROCOPY 0x02 /* refer the data until it is acknowledged (see tcp_zerocopy_completed()) */
+
 extern int
 tcp_init(void);
 
@@ -30,7 +44,15 @@ tcp_close(int id);
 extern ssize_t
 tcp_send(int id, uint8_t *data, size_t len);
 extern ssize_t
+tcp_sendmsg(int id, uint8_t *data, size_t len, int flags);
+extern int
+tcp_zerocopy_completed(int id, uint32_t *lo, uint32_t *hi);
+extern ssize_t
 tcp_receive(int id, uint8_t *buf, size_t size);
+extern ssize_t
+tcp_receive_borrow(int id, struct iovec *iov, int *iovcnt);
+extern int
+tcp_receive_release(int id, size_t len);
 
 extern int
 tcp_open(void);
@@ -42,5 +64,9 @@ extern int
 tcp_listen(int id, int backlog);
 extern int
 tcp_accept(int id, struct ip_endpoint *foreign);
+extern int
+tcp_setopt(int id, int opt, const void *val, size_t len);
+extern int
+tcp_getopt(int id, int opt, void *val, size_t *len);
 
 #endif
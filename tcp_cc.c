@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "tcp_cc.h"
+
+/*
+ * TCP Congestion Control
+ *
+ * The algorithms are selected per connection by name (see TCP_OPT_CONGESTION).
+ * TCP keeps cwnd/ssthresh in bytes and calls the hooks of the ops; this file
+ * provides the common part (initial window, pacing hint) and the built-in
+ * algorithms, NewReno (RFC 5681/6582) and CUBIC (RFC 8312).
+ *
+ * NOTE: The hooks are called with the PCB of the connection locked.
+ */
+
+#define TCP_CC_IW_SEGS 10 /* initial window (RFC 6928) */
+#define TCP_CC_IW_BYTES 14600
+
+#define TCP_CC_PACING_SS_RATIO 200 /* percent of cwnd per RTT in slow start */
+#define TCP_CC_PACING_CA_RATIO 120 /* percent of cwnd per RTT in congestion avoidance */
+
+static struct tcp_cc_ops *algorithms;
+
+int
+tcp_cc_register(struct tcp_cc_ops *ops)
+{
+    if (tcp_cc_lookup(ops->name)) {
+        errorf("already registered, name=%s", ops->name);
+        return -1;
+    }
+    ops->next = algorithms;
+    algorithms = ops;
+    infof("registered, name=%s", ops->name);
+    return 0;
+}
+
+struct tcp_cc_ops *
+tcp_cc_lookup(const char *name)
+{
+    struct tcp_cc_ops *ops;
+
+    for (ops = algorithms; ops; ops = ops->next) {
+        if (strncmp(ops->name, name, sizeof(ops->name)) == 0) {
+            return ops;
+        }
+    }
+    return NULL;
+}
+
+/* NOTE: called when the connection is established (the MSS is known) */
+void
+tcp_cc_start(struct tcp_cc *cc, uint32_t mss)
+{
+    cc->mss = mss;
+    cc->cwnd = MIN(TCP_CC_IW_SEGS * mss, MAX(2 * mss, TCP_CC_IW_BYTES));
+    cc->ssthresh = UINT32_MAX;
+    cc->acked = 0;
+    memset(cc->priv, 0, sizeof(cc->priv));
+    if (cc->ops->init) {
+        cc->ops->init(cc);
+    }
+}
+
+/* NOTE: a hint of the sending rate, TCP bounds the burst (GSO super-segment) by it */
+uint64_t
+tcp_cc_pacing_rate(struct tcp_cc *cc)
+{
+    if (cc->ops->pacing_rate) {
+        return cc->ops->pacing_rate(cc);
+    }
+    if (!cc->srtt) {
+        return 0;
+    }
+    return (uint64_t)cc->cwnd * 1000000 / cc->srtt * (cc->cwnd < cc->ssthresh ? TCP_CC_PACING_SS_RATIO : TCP_CC_PACING_CA_RATIO) / 100;
+}
+
+/* NOTE: called before a reduction which may turn out to be spurious */
+void
+tcp_cc_save(struct tcp_cc *cc)
+{
+    cc->prior_cwnd = cc->cwnd;
+    cc->prior_ssthresh = cc->ssthresh;
+}
+
+/* NOTE: the reduction since tcp_cc_save() turned out to be spurious */
+void
+tcp_cc_undo(struct tcp_cc *cc)
+{
+    cc->cwnd = MAX(cc->cwnd, cc->prior_cwnd);
+    cc->ssthresh = MAX(cc->ssthresh, cc->prior_ssthresh);
+    cc->acked = 0;
+}
+
+static uint32_t
+tcp_cc_halve(struct tcp_cc *cc, uint32_t flight)
+{
+    return MAX(flight / 2, 2 * cc->mss);
+}
+
+/*
+ * NewReno
+ */
+
+static void
+newreno_on_ack(struct tcp_cc *cc, uint32_t acked, uint32_t flight, const struct timeval *now)
+{
+    if (cc->cwnd < cc->ssthresh) {
+        /* slow start */
+        cc->cwnd += acked;
+        return;
+    }
+    /* congestion avoidance: one MSS per window acknowledged (byte counting) */
+    cc->acked += acked;
+    while (cc->acked >= cc->cwnd) {
+        cc->acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static void
+newreno_on_loss(struct tcp_cc *cc, uint32_t flight, const struct timeval *now)
+{
+    cc->ssthresh = tcp_cc_halve(cc, flight);
+    cc->cwnd = cc->ssthresh;
+    cc->acked = 0;
+}
+
+static void
+newreno_on_rto(struct tcp_cc *cc, uint32_t flight)
+{
+    cc->ssthresh = tcp_cc_halve(cc, flight);
+    cc->cwnd = cc->mss;
+    cc->acked = 0;
+}
+
+static struct tcp_cc_ops newreno = {
+    .name = "newreno",
+    .on_ack = newreno_on_ack,
+    .on_loss = newreno_on_loss,
+    .on_rto = newreno_on_rto,
+};
+
+/*
+ * CUBIC
+ *
+ * NOTE: The window is computed in segments: W(t) = C * (t - K)^3 + W_max
+ */
+
+#define CUBIC_C 0.4
+#define CUBIC_BETA 0.7
+
+struct cubic {
+    double w_max; /* window before the last reduction */
+    double w_last_max;
+    double k; /* seconds to reach w_max again */
+    double origin;
+    double w_est; /* window of the standard TCP (TCP-friendly region) */
+    double frac; /* fraction of the increase in bytes */
+    struct timeval epoch; /* start of the current congestion avoidance */
+};
+
+/* NOTE: must fit in struct tcp_cc.priv (cleared by tcp_cc_start) */
+#define CUBIC(x) ((struct cubic *)(x)->priv)
+
+static double
+cubic_cbrt(double x)
+{
+    double y;
+    int i;
+
+    if (x <= 0) {
+        return 0;
+    }
+    y = x > 1 ? x / 3 : 1;
+    for (i = 0; i < 40; i++) {
+        y = (2 * y + x / (y * y)) / 3;
+    }
+    return y;
+}
+
+static void
+cubic_reduce(struct tcp_cc *cc)
+{
+    struct cubic *c = CUBIC(cc);
+    double w;
+
+    w = (double)cc->cwnd / cc->mss;
+    if (w < c->w_last_max) {
+        /* fast convergence: release the bandwidth for the new flows */
+        c->w_max = w * (1 + CUBIC_BETA) / 2;
+    } else {
+        c->w_max = w;
+    }
+    c->w_last_max = w;
+    timerclear(&c->epoch);
+    cc->ssthresh = MAX((uint32_t)(cc->cwnd * CUBIC_BETA), 2 * cc->mss);
+}
+
+static void
+cubic_on_ack(struct tcp_cc *cc, uint32_t acked, uint32_t flight, const struct timeval *now)
+{
+    struct cubic *c = CUBIC(cc);
+    struct timeval diff;
+    double w, t, target, inc;
+
+    if (cc->cwnd < cc->ssthresh) {
+        /* slow start */
+        cc->cwnd += acked;
+        return;
+    }
+    w = (double)cc->cwnd / cc->mss;
+    if (!timerisset(&c->epoch)) {
+        c->epoch = *now;
+        if (w < c->w_max) {
+            c->k = cubic_cbrt((c->w_max - w) / CUBIC_C);
+            c->origin = c->w_max;
+        } else {
+            c->k = 0;
+            c->origin = w;
+        }
+        c->w_est = w;
+    }
+    timersub(now, &c->epoch, &diff);
+    t = diff.tv_sec + diff.tv_usec / 1000000.0 + cc->srtt / 1000000.0;
+    target = c->origin + CUBIC_C * (t - c->k) * (t - c->k) * (t - c->k);
+    if (target > w * 1.5) {
+        target = w * 1.5;
+    }
+    /* TCP-friendly region: not slower than the standard TCP */
+    c->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * ((double)acked / cc->mss) / w;
+    if (target < c->w_est) {
+        target = c->w_est;
+    }
+    if (target <= w) {
+        return;
+    }
+    inc = (target - w) / w * acked + c->frac;
+    cc->cwnd += (uint32_t)inc;
+    c->frac = inc - (uint32_t)inc;
+}
+
+static void
+cubic_on_loss(struct tcp_cc *cc, uint32_t flight, const struct timeval *now)
+{
+    cubic_reduce(cc);
+    cc->cwnd = cc->ssthresh;
+}
+
+static void
+cubic_on_rto(struct tcp_cc *cc, uint32_t flight)
+{
+    cubic_reduce(cc);
+    cc->cwnd = cc->mss;
+}
+
+static struct tcp_cc_ops cubic = {
+    .name = "cubic",
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_rto = cubic_on_rto,
+};
+
+int
+tcp_cc_init(void)
+{
+    if (tcp_cc_register(&newreno) == -1) {
+        errorf("tcp_cc_register() failure");
+        return -1;
+    }
+    if (tcp_cc_register(&cubic) == -1) {
+        errorf("tcp_cc_register() failure");
+        return -1;
+    }
+    return 0;
+}
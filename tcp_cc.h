@@ -0,0 +1,52 @@
+#ifndef TCP_CC_H
+#define TCP_CC_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#define TCP_CC_NAME_LEN 16
+
+#ifndef TCP_CC_DEFAULT
+#define TCP_CC_DEFAULT "cubic"
+#endif
+
+struct tcp_cc {
+    struct tcp_cc_ops *ops;
+    uint32_t cwnd; /* bytes */
+    uint32_t ssthresh; /* bytes */
+    uint32_t mss;
+    uint32_t srtt; /* micro seconds, given by TCP (0: unknown) */
+    uint32_t acked; /* bytes acknowledged toward the next increase in congestion avoidance */
+    uint32_t prior_cwnd; /* saved by tcp_cc_save() for tcp_cc_undo() */
+    uint32_t prior_ssthresh;
+    uint64_t priv[8]; /* private data of the algorithm */
+};
+
+struct tcp_cc_ops {
+    struct tcp_cc_ops *next;
+    char name[TCP_CC_NAME_LEN];
+    void (*init)(struct tcp_cc *cc);
+    void (*on_ack)(struct tcp_cc *cc, uint32_t acked, uint32_t flight, const struct timeval *now);
+    void (*on_loss)(struct tcp_cc *cc, uint32_t flight, const struct timeval *now); /* fast retransmit */
+    void (*on_rto)(struct tcp_cc *cc, uint32_t flight);
+    uint64_t (*pacing_rate)(struct tcp_cc *cc); /* bytes per second (optional) */
+};
+
+extern int
+tcp_cc_register(struct tcp_cc_ops *ops);
+extern struct tcp_cc_ops *
+tcp_cc_lookup(const char *name);
+
+extern void
+tcp_cc_start(struct tcp_cc *cc, uint32_t mss);
+extern uint64_t
+tcp_cc_pacing_rate(struct tcp_cc *cc);
+extern void
+tcp_cc_save(struct tcp_cc *cc);
+extern void
+tcp_cc_undo(struct tcp_cc *cc);
+
+extern int
+tcp_cc_init(void);
+
+#endif
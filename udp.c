@@ -10,10 +10,17 @@
 #include "util.h"
 #include "net.h"
 #include "ip.h"
+#include "gso.h"
 #include "udp.h"
 
 #define UDP_PCB_SIZE 16
 
+#ifndef UDP_RCVBUF_SIZE_DEFAULT
+#define UDP_RCVBUF_SIZE_DEFAULT 262144
+#endif
+#define UDP_RCVBUF_SIZE_MIN 1024
+#define UDP_RCVBUF_SIZE_MAX (16 * 1024 * 1024)
+
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
 #define UDP_PCB_STATE_CLOSING 2
@@ -40,6 +47,9 @@ struct udp_hdr {
 struct udp_pcb {
     int state;
     struct ip_endpoint local;
+    uint16_t segment; /* size of each datagram split by GSO (0: disabled) */
+    size_t rcvbuf; /* limit of the data in the receive queue */
+    size_t queued; /* data in the receive queue */
     struct queue_head queue; /* receive queue */
     struct sched_ctx ctx;
 };
@@ -84,6 +94,7 @@ udp_pcb_alloc(void)
     for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
         if (pcb->state == UDP_PCB_STATE_FREE) {
             pcb->state = UDP_PCB_STATE_OPEN;
+            pcb->rcvbuf = UDP_RCVBUF_SIZE_DEFAULT;
             sched_ctx_init(&pcb->ctx);
             return pcb;
         }
@@ -104,6 +115,8 @@ udp_pcb_release(struct udp_pcb *pcb)
     pcb->state = UDP_PCB_STATE_FREE;
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
+    pcb->segment = 0;
+    pcb->queued = 0;
     while ((entry = queue_pop(&pcb->queue)) != NULL) {
         memory_free(entry);
     }
@@ -188,6 +201,12 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         mutex_unlock(&mutex);
         return;
     }
+    if (pcb->queued + (len - sizeof(*hdr)) > pcb->rcvbuf) {
+        /* NOTE: the reader can not keep up, drop it as the receive buffer is full */
+        mutex_unlock(&mutex);
+        debugf("receive queue is full, queued=%zu", pcb->queued);
+        return;
+    }
     entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
     if (!entry) {
         mutex_unlock(&mutex);
@@ -203,12 +222,17 @@ udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
         errorf("queue_push() failure");
         return;
     }
+    pcb->queued += entry->len;
     sched_wakeup(&pcb->ctx);
     mutex_unlock(&mutex);
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+/*
+ * NOTE: If gso_size is not zero, the data is split into datagrams of gso_size
+ *       bytes by GSO (see gso.c) and the checksum is left to it.
+ */
+static ssize_t
+udp_output_gso(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len, uint16_t gso_size)
 {
     uint8_t buf[IP_PAYLOAD_SIZE_MAX];
     struct udp_hdr *hdr;
@@ -234,17 +258,25 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
     pseudo.protocol = IP_PROTOCOL_UDP;
     pseudo.len = hton16(total);
     psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    debugf("%s => %s, len=%zu (payload=%zu)",
-        ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
+    if (!gso_size) {
+        hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    }
+    debugf("%s => %s, len=%zu (payload=%zu, gso_size=%u)",
+        ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len, gso_size);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
+    if (ip_output_gso(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr, gso_size) == -1) {
+        errorf("ip_output_gso() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    return udp_output_gso(src, dst, data, len, 0);
+}
+
 static void
 event_handler(void *arg)
 {
@@ -336,14 +368,114 @@ udp_bind(int id, struct ip_endpoint *local)
     return 0;
 }
 
+int
+udp_setopt(int id, int opt, const void *val, size_t len)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    switch (opt) {
+    case UDP_OPT_SEGMENT:
+        if (len != sizeof(int) || *(int *)val < 0 || *(int *)val > UINT16_MAX) {
+            errorf("invalid value, opt=%d", opt);
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        pcb->segment = *(int *)val;
+        break;
+    case UDP_OPT_RCVBUF:
+        if (len != sizeof(int) || *(int *)val < UDP_RCVBUF_SIZE_MIN || *(int *)val > UDP_RCVBUF_SIZE_MAX) {
+            errorf("invalid value, opt=%d", opt);
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        pcb->rcvbuf = *(int *)val;
+        break;
+    default:
+        errorf("unknown option, opt=%d", opt);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+int
+udp_getopt(int id, int opt, void *val, size_t *len)
+{
+    struct udp_pcb *pcb;
+
+    mutex_lock(&mutex);
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    switch (opt) {
+    case UDP_OPT_SEGMENT:
+        if (*len < sizeof(int)) {
+            errorf("too short, opt=%d", opt);
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        *(int *)val = pcb->segment;
+        *len = sizeof(int);
+        break;
+    case UDP_OPT_RCVBUF:
+        if (*len < sizeof(int)) {
+            errorf("too short, opt=%d", opt);
+            mutex_unlock(&mutex);
+            return -1;
+        }
+        *(int *)val = pcb->rcvbuf;
+        *len = sizeof(int);
+        break;
+    default:
+        errorf("unknown option, opt=%d", opt);
+        mutex_unlock(&mutex);
+        return -1;
+    }
+    mutex_unlock(&mutex);
+    return 0;
+}
+
+/* NOTE: an unbound socket takes the source address of the path selected by the flow hash (multipath) */
+static int
+udp_select_source(struct ip_endpoint *local, ip_addr_t bound, struct ip_endpoint *foreign)
+{
+    struct ip_iface *iface;
+    char addr[IP_ADDR_STR_LEN];
+
+    if (bound != IP_ADDR_ANY) {
+        local->addr = bound;
+        return 0;
+    }
+    iface = ip_route_get_iface_flow(IP_PROTOCOL_UDP, foreign->addr, local->port, foreign->port);
+    if (!iface) {
+        errorf("iface not found that can reach foreign address, addr=%s",
+            ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
+        return -1;
+    }
+    local->addr = iface->unicast;
+    debugf("select local address, addr=%s", ip_addr_ntop(local->addr, addr, sizeof(addr)));
+    return 0;
+}
+
 ssize_t
 udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
 {
     struct udp_pcb *pcb;
     struct ip_endpoint local;
-    struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     uint32_t p;
+    uint16_t segment;
 
     mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
@@ -352,22 +484,16 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
         mutex_unlock(&mutex);
         return -1;
     }
-    local.addr = pcb->local.addr;
-    if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("iface not found that can reach foreign address, addr=%s",
-                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        local.addr = iface->unicast;
-        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
-    }
     if (!pcb->local.port) {
         for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
-                pcb->local.port = hton16(p);
+            local.port = hton16(p);
+            if (udp_select_source(&local, pcb->local.addr, foreign) == -1) {
+                errorf("udp_select_source() failure");
+                mutex_unlock(&mutex);
+                return -1;
+            }
+            if (!udp_pcb_select(local.addr, local.port)) {
+                pcb->local.port = local.port;
                 debugf("dinamic assign local port, port=%d", p);
                 break;
             }
@@ -377,9 +503,23 @@ udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
             mutex_unlock(&mutex);
             return -1;
         }
+    } else {
+        local.port = pcb->local.port;
+        if (udp_select_source(&local, pcb->local.addr, foreign) == -1) {
+            errorf("udp_select_source() failure");
+            mutex_unlock(&mutex);
+            return -1;
+        }
     }
-    local.port = pcb->local.port;
+    segment = pcb->segment;
     mutex_unlock(&mutex);
+    if (segment && len > segment) {
+        if (len > (size_t)segment * GSO_SEGS_MAX) {
+            errorf("too long, len=%zu, segment=%u", len, segment);
+            return -1;
+        }
+        return udp_output_gso(&local, foreign, data, len, segment);
+    }
     return udp_output(&local, foreign, data, len);
 }
 
@@ -411,6 +551,7 @@ udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
             return -1;
         }
     }
+    pcb->queued -= entry->len;
     mutex_unlock(&mutex);
     if (foreign) {
         *foreign = entry->foreign;
@@ -6,6 +6,9 @@
 
 #include "ip.h"
 
+#define UDP_OPT_SEGMENT 1 /* int: split a large datagram into datagrams of this size by GSO (0: disabled) */
+#define UDP_OPT_RCVBUF  2 /* int: limit of the data queued for the reader (the datagrams beyond it are dropped) */
+
 extern ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *buf, size_t len);
 
@@ -22,5 +25,9 @@ extern ssize_t
 udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
 extern int
 udp_close(int id);
+extern int
+udp_setopt(int id, int opt, const void *val, size_t len);
+extern int
+udp_getopt(int id, int opt, void *val, size_t *len);
 
 #endif
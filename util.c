@@ -232,3 +232,79 @@ cksum16(uint16_t *addr, uint16_t count, uint32_t init)
     }
     return ~(uint16_t)sum;
 }
+
+/* FNV-1a with a final avalanche so that the result can be reduced by modulo */
+uint32_t
+hash32(const void *data, size_t size, uint32_t init)
+{
+    const uint8_t *p;
+    uint32_t h;
+
+    h = 2166136261u ^ init;
+    for (p = data; size; size--) {
+        h ^= *(p++);
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+#define SIPHASH_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPHASH_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIPHASH_ROTL(v1, 13); v1 ^= v0; v0 = SIPHASH_ROTL(v0, 32); \
+        v2 += v3; v3 = SIPHASH_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIPHASH_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIPHASH_ROTL(v1, 17); v1 ^= v2; v2 = SIPHASH_ROTL(v2, 32); \
+    } while (0)
+
+static uint64_t
+siphash_load64(const uint8_t *p, size_t n)
+{
+    uint64_t v = 0;
+
+    while (n--) {
+        v |= (uint64_t)p[n] << (8 * n); /* little endian */
+    }
+    return v;
+}
+
+/* SipHash-2-4, a keyed MAC for the short inputs (e.g. SYN cookies) that must not be forged */
+uint64_t
+siphash24(const uint8_t key[16], const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t k0, k1, v0, v1, v2, v3, m, b;
+    size_t left;
+
+    k0 = siphash_load64(key, 8);
+    k1 = siphash_load64(key + 8, 8);
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+    b = (uint64_t)size << 56;
+    for (left = size; left >= 8; left -= 8, p += 8) {
+        m = siphash_load64(p, 8);
+        v3 ^= m;
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        SIPHASH_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    b |= siphash_load64(p, left);
+    v3 ^= b;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    SIPHASH_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -83,4 +83,9 @@ ntoh32(uint32_t n);
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
 
+extern uint32_t
+hash32(const void *data, size_t size, uint32_t init);
+extern uint64_t
+siphash24(const uint8_t key[16], const void *data, size_t size);
+
 #endif